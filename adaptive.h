@@ -0,0 +1,168 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include "util/StatefulTimer.h"
+
+// adaptive repetition, shared by the benchmarks: rather than a fixed number of
+// iterations, repeat a measurement until the 95% confidence interval of the
+// median is within targetPercent of the median, or budgetMilliseconds of wall
+// time has gone, whichever comes first
+//
+// the confidence interval is distribution-free, from order statistics: for n
+// sorted samples, ranks n/2 -+ 1.96 * sqrt(n) / 2 bound the median with ~95%
+// confidence, so it isnt thrown by the long right tail timings usually have
+//
+// outliers are tukey far-out values, beyond 3 * IQR from the quartiles.  they
+// stay in the samples, since the median doesnt care, but are reported, so
+// spikes like one launch count taking 40% longer than its neighbours show up
+//
+// usage:
+//   AdaptiveResult result = measureAdaptive([&]() {
+//     double start = StatefulTimer::instance()->getSystemMilliseconds();
+//     ... run, cl->finish() ...
+//     return StatefulTimer::instance()->getSystemMilliseconds() - start;
+//   });
+//   cout << ... << adaptiveString(result) << endl;
+//
+// where the thing measured is a single launch, use measureAdaptiveBatched,
+// which is passed how many launches to run per sample, and picks that itself,
+// rather than the caller fixing an its count:
+//   AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+//     double start = StatefulTimer::instance()->getSystemMilliseconds();
+//     for( int it = 0; it < batchSize; it++ ) {
+//       ... launch ...
+//     }
+//     cl->finish();
+//     return StatefulTimer::instance()->getSystemMilliseconds() - start;
+//   });
+// a calibration run, which doubles as the warmup, doubles the batch from 1
+// until one batch takes minBatchMilliseconds, so the finish and the timer
+// resolution are amortized over fast launches, while a slow launch is run
+// once per sample.  samples, and so the median, are then per launch
+
+typedef struct AdaptiveResult {
+  std::vector<double> samples;
+  double median;
+  double ciLow;
+  double ciHigh;
+  bool converged;
+  int numOutliers;
+  double maxOutlier;
+  // launches per sample, 1 unless batched
+  int batchSize;
+  // every launch run, including calibration, for checking results that
+  // accumulate over launches
+  long long totalLaunches;
+} AdaptiveResult;
+
+// value at 1-based rank in sorted samples, clamped to range
+static inline double adaptiveRank(const std::vector<double> &sorted, int rank) {
+  if(rank < 1) {
+    rank = 1;
+  }
+  if(rank > (int)sorted.size()) {
+    rank = sorted.size();
+  }
+  return sorted[rank - 1];
+}
+
+static inline void adaptiveSummarize(AdaptiveResult *result) {
+  std::vector<double> sorted = result->samples;
+  std::sort(sorted.begin(), sorted.end());
+  int n = sorted.size();
+  if(n % 2 == 1) {
+    result->median = sorted[n / 2];
+  } else {
+    result->median = (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+  }
+  double halfWidth = 1.96 * sqrt((double)n) / 2;
+  result->ciLow = adaptiveRank(sorted, (int)floor(n / 2.0 - halfWidth));
+  result->ciHigh = adaptiveRank(sorted, (int)ceil(1 + n / 2.0 + halfWidth));
+
+  double q1 = adaptiveRank(sorted, (int)ceil(n * 0.25));
+  double q3 = adaptiveRank(sorted, (int)ceil(n * 0.75));
+  double iqr = q3 - q1;
+  result->numOutliers = 0;
+  result->maxOutlier = 0;
+  for( int i = 0; i < n; i++ ) {
+    if(sorted[i] > q3 + 3 * iqr || sorted[i] < q1 - 3 * iqr) {
+      result->numOutliers++;
+      if(sorted[i] > result->maxOutlier) {
+        result->maxOutlier = sorted[i];
+      }
+    }
+  }
+}
+
+// sampling loop shared by both forms; measure() returns one sample
+template<typename Measure>
+inline void adaptiveSample(AdaptiveResult *result, Measure measure, double targetPercent, double budgetMilliseconds,
+    int minSamples, int maxSamples) {
+  AdaptiveResult &r = *result;
+  r.converged = false;
+  double start = StatefulTimer::instance()->getSystemMilliseconds();
+  while((int)r.samples.size() < maxSamples) {
+    r.samples.push_back(measure());
+    r.totalLaunches += r.batchSize;
+    adaptiveSummarize(&r);
+    if((int)r.samples.size() >= minSamples
+        && (r.ciHigh - r.ciLow) / 2 <= r.median * targetPercent / 100) {
+      r.converged = true;
+      break;
+    }
+    if(StatefulTimer::instance()->getSystemMilliseconds() - start > budgetMilliseconds
+        && (int)r.samples.size() >= 2) {
+      break;
+    }
+  }
+}
+
+template<typename Measure>
+inline AdaptiveResult measureAdaptive(Measure measure, double targetPercent = 2.0, double budgetMilliseconds = 2000,
+    int minSamples = 3, int maxSamples = 1000) {
+  AdaptiveResult result;
+  result.batchSize = 1;
+  result.totalLaunches = 0;
+  adaptiveSample(&result, measure, targetPercent, budgetMilliseconds, minSamples, maxSamples);
+  return result;
+}
+
+template<typename Measure>
+inline AdaptiveResult measureAdaptiveBatched(Measure measure, double targetPercent = 2.0, double budgetMilliseconds = 2000,
+    int minSamples = 3, int maxSamples = 1000, double minBatchMilliseconds = 5) {
+  AdaptiveResult result;
+  result.batchSize = 1;
+  result.totalLaunches = 1;
+  double milliseconds = measure(1);
+  while(milliseconds < minBatchMilliseconds && result.batchSize < (1 << 20)) {
+    result.batchSize *= 2;
+    result.totalLaunches += result.batchSize;
+    milliseconds = measure(result.batchSize);
+  }
+  int batchSize = result.batchSize;
+  adaptiveSample(&result, [&]() {
+    return measure(batchSize) / batchSize;
+  }, targetPercent, budgetMilliseconds, minSamples, maxSamples);
+  return result;
+}
+
+static inline std::string adaptiveString(const AdaptiveResult &result) {
+  std::ostringstream s;
+  s << " samples=" << result.samples.size();
+  if(result.batchSize > 1) {
+    s << " batch=" << result.batchSize;
+  }
+  s << " median=" << result.median << "ms"
+    << " ci95=[" << result.ciLow << "," << result.ciHigh << "]ms";
+  if(!result.converged) {
+    s << " (budget ran out)";
+  }
+  if(result.numOutliers > 0) {
+    s << " outliers=" << result.numOutliers << " (max " << result.maxOutlier << "ms)";
+  }
+  return s.str();
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <chrono>
+#include "EasyCL.h"
+
+// timeline export, as chrome trace-event json, for chrome://tracing or
+// perfetto: every kernel, transfer and host blocking call, one track per
+// queue, and one per host thread, so gaps between launches, overlap, and the
+// host stalling on the device are visible, where dumpProfiling() only gives
+// per-kernel totals
+//
+// device events come from OpenCL event profiling, so the queue needs
+// CL_QUEUE_PROFILING_ENABLE.  device timestamps are moved onto the host
+// steady clock, using the queued timestamp of a marker enqueued when the
+// queue is added
+//
+// events go to the file as soon as they complete, rather than being kept
+// until the end, so a long run doesnt build up in memory.  at most
+// maxPending device events are held; past that, device() waits for the oldest
+//
+// usage:
+//   ChromeTrace trace;
+//   trace.open("trace.json");
+//   int queueTrack = trace.addQueue(queue, "queue");
+//   int hostTrack = trace.addTrack("host");
+//   long long start = ChromeTrace::now();
+//   clEnqueueNDRangeKernel(queue, kernel, ..., &event);
+//   trace.host(hostTrack, "enqueue", start, ChromeTrace::now());
+//   trace.device(queueTrack, event, "apply3", "kernel");
+//   ...
+//   trace.close();
+// device() retains the event, so the caller can release its own reference
+// as usual
+
+class ChromeTrace {
+public:
+  static const int maxPending = 4096;
+
+  static long long now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+  ChromeTrace() :
+      numTracks(0),
+      numUnprofiled(0),
+      first(true) {
+  }
+  bool isOpen() {
+    return file.is_open();
+  }
+  void open(std::string filename) {
+    file.open(filename.c_str());
+    file << "[";
+    first = true;
+  }
+  // a named track, eg a host thread
+  int addTrack(std::string name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    int track = ++numTracks;
+    std::ostringstream event;
+    event << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track
+      << ",\"args\":{\"name\":\"" << name << "\"}}";
+    write(event.str());
+    return track;
+  }
+  // a track for a queue, with its device to host clock offset
+  int addQueue(cl_command_queue queue, std::string name) {
+    int track = addTrack(name);
+    cl_event marker;
+    long long hostTime = now();
+    EasyCL::checkError(clEnqueueMarker(queue, &marker));
+    clFinish(queue);
+    cl_ulong queued = 0;
+    cl_int err = clGetEventProfilingInfo(marker, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, 0);
+    clReleaseEvent(marker);
+    std::lock_guard<std::mutex> lock(mutex);
+    deviceOffsets[track] = err == CL_SUCCESS ? hostTime - (long long)queued : 0;
+    return track;
+  }
+  void host(int track, std::string name, long long startNanoseconds, long long endNanoseconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    writeSlice(track, name, "host", startNanoseconds, endNanoseconds);
+  }
+  void device(int track, cl_event event, std::string name, std::string category) {
+    clRetainEvent(event);
+    std::lock_guard<std::mutex> lock(mutex);
+    Pending pending = { track, event, name, category };
+    this->pending.push_back(pending);
+    while((int)this->pending.size() > maxPending) {
+      clWaitForEvents(1, &this->pending.front().event);
+      writePending();
+    }
+    writeCompleted();
+  }
+  // writes whatever has completed, without blocking
+  void poll() {
+    std::lock_guard<std::mutex> lock(mutex);
+    writeCompleted();
+  }
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    while(pending.size() > 0) {
+      clWaitForEvents(1, &pending.front().event);
+      writePending();
+    }
+    file << "\n]\n";
+    file.close();
+    if(numUnprofiled > 0) {
+      std::cout << "chrometrace: " << numUnprofiled << " device events had no profiling info, is the queue profiling?" << std::endl;
+    }
+  }
+
+protected:
+  typedef struct Pending {
+    int track;
+    cl_event event;
+    std::string name;
+    std::string category;
+  } Pending;
+
+  void write(std::string event) {
+    file << (first ? "\n" : ",\n") << event;
+    first = false;
+  }
+  void writeSlice(int track, std::string name, std::string category, long long startNanoseconds, long long endNanoseconds) {
+    std::ostringstream event;
+    event.precision(15);
+    event << "{\"name\":\"" << name << "\",\"cat\":\"" << category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << track
+      << ",\"ts\":" << startNanoseconds / 1000.0 << ",\"dur\":" << (endNanoseconds - startNanoseconds) / 1000.0 << "}";
+    write(event.str());
+  }
+  // oldest pending event, which must be complete
+  void writePending() {
+    Pending event = pending.front();
+    pending.pop_front();
+    cl_ulong start = 0;
+    cl_ulong end = 0;
+    if(clGetEventProfilingInfo(event.event, CL_PROFILING_COMMAND_START, sizeof(start), &start, 0) == CL_SUCCESS
+        && clGetEventProfilingInfo(event.event, CL_PROFILING_COMMAND_END, sizeof(end), &end, 0) == CL_SUCCESS) {
+      long long offset = deviceOffsets[event.track];
+      writeSlice(event.track, event.name, event.category, (long long)start + offset, (long long)end + offset);
+    } else {
+      numUnprofiled++;
+    }
+    clReleaseEvent(event.event);
+  }
+  // in order, stopping at the first that hasnt completed
+  void writeCompleted() {
+    while(pending.size() > 0) {
+      cl_int status = CL_COMPLETE;
+      clGetEventInfo(pending.front().event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, 0);
+      // negative is an error, which wont complete either, so write it out
+      if(status > CL_COMPLETE) {
+        break;
+      }
+      writePending();
+    }
+  }
+
+  std::ofstream file;
+  std::mutex mutex;
+  std::deque<Pending> pending;
+  std::map<int, long long> deviceOffsets;
+  int numTracks;
+  int numUnprofiled;
+  bool first;
+};
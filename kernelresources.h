@@ -0,0 +1,229 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include "EasyCL.h"
+#include "util/easycl_stringhelper.h"
+
+// per-kernel resource usage, shared by the benchmarks, so that a jump in
+// timing can be matched to a resource cliff, eg register pressure cutting
+// the maximum workgroup size, or local memory limiting workgroups per
+// compute unit
+//
+// CLKernel doesnt expose its cl_kernel, so for kernels built through EasyCL
+// we build the same source and options again through the api, and query
+// that.  results are cached by device, source, kernel name, options and
+// workgroup size, so calling this in a loop only compiles once
+//
+// usage:
+//   cout << ... << kernelResourceString(cl, source, "test", workgroupSize) << endl;
+// or, for kernels built through the api directly:
+//   cout << ... << kernelResourceString(cl, kernel, workgroupSize) << endl;
+//
+// reports, where the driver allows:
+//   wgmax, wgmultiple: CL_KERNEL_WORK_GROUP_SIZE and its preferred multiple
+//   private, local: CL_KERNEL_PRIVATE_MEM_SIZE, CL_KERNEL_LOCAL_MEM_SIZE
+//   binary: compiled program size
+//   regs, cmem: from ptxas, on nvidia, via -cl-nv-verbose
+//   wgs/cu: resident workgroups per compute unit, as limited by local memory,
+//     and on nvidia registers
+//   occupancy: resident work items over the maximum per compute unit, for
+//     vendors where that maximum is known, ie nvidia and amd
+
+#ifndef CL_DEVICE_COMPUTE_CAPABILITY_MAJOR_NV
+#define CL_DEVICE_COMPUTE_CAPABILITY_MAJOR_NV 0x4000
+#endif
+#ifndef CL_DEVICE_COMPUTE_CAPABILITY_MINOR_NV
+#define CL_DEVICE_COMPUTE_CAPABILITY_MINOR_NV 0x4001
+#endif
+#ifndef CL_DEVICE_REGISTERS_PER_BLOCK_NV
+#define CL_DEVICE_REGISTERS_PER_BLOCK_NV 0x4002
+#endif
+#ifndef CL_DEVICE_WARP_SIZE_NV
+#define CL_DEVICE_WARP_SIZE_NV 0x4003
+#endif
+
+static std::map<std::string, std::string> kernelResourceCache;
+
+static inline std::string kernelResourceDeviceString(cl_device_id device, cl_device_info info) {
+  size_t size = 0;
+  clGetDeviceInfo(device, info, 0, 0, &size);
+  std::vector<char> value(size + 1, 0);
+  clGetDeviceInfo(device, info, size, &value[0], 0);
+  return std::string(&value[0]);
+}
+
+// sums "Used N registers, X bytes cmem[0], Y bytes cmem[2]" following the
+// entry for kernelName in the ptxas log
+static inline void kernelResourceParseNvLog(std::string log, std::string kernelName, int *registers, int *constantBytes) {
+  size_t pos = log.find("entry function '" + kernelName + "'");
+  if(pos == std::string::npos) {
+    return;
+  }
+  pos = log.find("Used ", pos);
+  if(pos == std::string::npos) {
+    return;
+  }
+  std::string line = log.substr(pos, log.find("\n", pos) - pos);
+  *registers = atoi(line.substr(5).c_str());
+  *constantBytes = 0;
+  size_t cmem = line.find(" bytes cmem[");
+  while(cmem != std::string::npos) {
+    size_t start = line.rfind(", ", cmem);
+    *constantBytes += atoi(line.substr(start + 2, cmem - start - 2).c_str());
+    cmem = line.find(" bytes cmem[", cmem + 1);
+  }
+}
+
+// resident threads and blocks per sm, by compute capability, from the cuda
+// programming guide's table
+static inline void kernelResourceNvLimits(int major, int minor, int *maxItems, int *maxWorkgroups) {
+  *maxItems = 2048;
+  *maxWorkgroups = 32;
+  if(major < 2) {
+    *maxItems = 1024;
+    *maxWorkgroups = 8;
+  } else if(major == 2) {
+    *maxItems = 1536;
+    *maxWorkgroups = 8;
+  } else if(major == 3) {
+    *maxWorkgroups = 16;
+  } else if(major == 7 && minor == 5) {
+    *maxItems = 1024;
+    *maxWorkgroups = 16;
+  } else if(major == 8 && minor == 9) {
+    *maxItems = 1536;
+    *maxWorkgroups = 24;
+  } else if(major == 8 && minor > 0) {
+    *maxItems = 1536;
+    *maxWorkgroups = 16;
+  }
+}
+
+static inline std::string kernelResourceString(EasyCL *cl, std::string source, std::string kernelName, int workgroupSize, std::string options = "") {
+  std::ostringstream deviceKey;
+  deviceKey << cl->device;
+  std::string key = deviceKey.str() + '\0' + source + '\0' + kernelName + '\0' + options + '\0' + easycl::toString(workgroupSize);
+  if(kernelResourceCache.find(key) != kernelResourceCache.end()) {
+    return kernelResourceCache[key];
+  }
+  cl_device_id device = cl->device;
+  std::string vendor = kernelResourceDeviceString(device, CL_DEVICE_VENDOR);
+  bool nvidia = vendor.find("NVIDIA") != std::string::npos;
+  bool amd = vendor.find("Advanced Micro Devices") != std::string::npos || vendor.find("AMD") != std::string::npos;
+  if(nvidia && kernelResourceDeviceString(device, CL_DEVICE_EXTENSIONS).find("cl_nv_compiler_options") != std::string::npos) {
+    options += " -cl-nv-verbose";
+  }
+
+  std::ostringstream result;
+  result << " kernel=" << kernelName;
+  cl_int err;
+  const char *sourceChars = source.c_str();
+  cl_program program = clCreateProgramWithSource(*cl->context, 1, &sourceChars, 0, &err);
+  if(err == CL_SUCCESS) {
+    err = clBuildProgram(program, 1, &device, options.c_str(), 0, 0);
+  }
+  cl_kernel kernel = 0;
+  if(err == CL_SUCCESS) {
+    kernel = clCreateKernel(program, kernelName.c_str(), &err);
+  }
+  if(err != CL_SUCCESS) {
+    result << " resources=unavailable(error " << err << ")";
+  } else {
+    size_t maxWorkgroupSize = 0;
+    size_t preferredMultiple = 0;
+    cl_ulong privateBytes = 0;
+    cl_ulong localBytes = 0;
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxWorkgroupSize), &maxWorkgroupSize, 0);
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(preferredMultiple), &preferredMultiple, 0);
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(privateBytes), &privateBytes, 0);
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(localBytes), &localBytes, 0);
+    size_t binaryBytes = 0;
+    clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binaryBytes), &binaryBytes, 0);
+    int registers = -1;
+    int constantBytes = -1;
+    if(nvidia) {
+      size_t logSize = 0;
+      clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, 0, &logSize);
+      std::vector<char> log(logSize + 1, 0);
+      clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, &log[0], 0);
+      kernelResourceParseNvLog(&log[0], kernelName, &registers, &constantBytes);
+    }
+    result << " wgmax=" << maxWorkgroupSize << " wgmultiple=" << preferredMultiple
+      << " private=" << privateBytes << "B local=" << localBytes << "B binary=" << binaryBytes << "B";
+    if(registers >= 0) {
+      result << " regs=" << registers << " cmem=" << constantBytes << "B";
+    }
+
+    // resident workgroups per compute unit, from whichever limits we know
+    int maxResidentItems = 0;
+    int maxResidentWorkgroups = 0;
+    if(nvidia) {
+      cl_uint major = 0;
+      cl_uint minor = 0;
+      clGetDeviceInfo(device, CL_DEVICE_COMPUTE_CAPABILITY_MAJOR_NV, sizeof(major), &major, 0);
+      clGetDeviceInfo(device, CL_DEVICE_COMPUTE_CAPABILITY_MINOR_NV, sizeof(minor), &minor, 0);
+      kernelResourceNvLimits(major, minor, &maxResidentItems, &maxResidentWorkgroups);
+    } else if(amd) {
+      // gcn: 4 simds, 10 wavefronts of 64 each, and up to 40 workgroups
+      maxResidentItems = 2560;
+      maxResidentWorkgroups = 40;
+    }
+    int residentWorkgroups = -1;
+    if(maxResidentItems > 0) {
+      // small workgroups run out of block slots before they run out of threads,
+      // eg 64 items on kepler is 16 blocks, so 50%
+      residentWorkgroups = std::min(maxResidentItems / workgroupSize, maxResidentWorkgroups);
+    }
+    if(localBytes > 0) {
+      cl_ulong localMemSize = 0;
+      clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMemSize), &localMemSize, 0);
+      int byLocal = (int)(localMemSize / localBytes);
+      residentWorkgroups = residentWorkgroups < 0 ? byLocal : std::min(residentWorkgroups, byLocal);
+    }
+    if(registers > 0) {
+      cl_uint registersPerCU = 0;
+      cl_uint warpSize = 32;
+      clGetDeviceInfo(device, CL_DEVICE_REGISTERS_PER_BLOCK_NV, sizeof(registersPerCU), &registersPerCU, 0);
+      clGetDeviceInfo(device, CL_DEVICE_WARP_SIZE_NV, sizeof(warpSize), &warpSize, 0);
+      int warpItems = ((workgroupSize + warpSize - 1) / warpSize) * warpSize;
+      residentWorkgroups = std::min(residentWorkgroups, (int)(registersPerCU / (registers * warpItems)));
+    }
+    if(residentWorkgroups >= 0) {
+      result << " wgs/cu=" << residentWorkgroups;
+    }
+    if(maxResidentItems > 0) {
+      result << " occupancy=" << (int)(std::min(residentWorkgroups * workgroupSize, maxResidentItems) * 100.0 / maxResidentItems) << "%";
+    }
+  }
+  if(kernel != 0) {
+    clReleaseKernel(kernel);
+  }
+  if(program != 0) {
+    clReleaseProgram(program);
+  }
+  kernelResourceCache[key] = result.str();
+  return result.str();
+}
+
+// for kernels built through the api: fetch the source, name and build options
+// back, and go through the same path, so nvidia still gets the verbose build
+static inline std::string kernelResourceString(EasyCL *cl, cl_kernel kernel, int workgroupSize) {
+  cl_program program;
+  clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(program), &program, 0);
+  size_t size = 0;
+  clGetProgramInfo(program, CL_PROGRAM_SOURCE, 0, 0, &size);
+  std::vector<char> source(size + 1, 0);
+  clGetProgramInfo(program, CL_PROGRAM_SOURCE, size, &source[0], 0);
+  clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, 0, &size);
+  std::vector<char> name(size + 1, 0);
+  clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, size, &name[0], 0);
+  clGetProgramBuildInfo(program, cl->device, CL_PROGRAM_BUILD_OPTIONS, 0, 0, &size);
+  std::vector<char> options(size + 1, 0);
+  clGetProgramBuildInfo(program, cl->device, CL_PROGRAM_BUILD_OPTIONS, size, &options[0], 0);
+  return kernelResourceString(cl, std::string(&source[0]), std::string(&name[0]), workgroupSize, std::string(&options[0]));
+}
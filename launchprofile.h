@@ -0,0 +1,115 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+
+// launch-path instrumentation: timestamps each phase of each launch, and
+// reports latency percentiles and a log2 histogram, per kernel and per phase
+//
+// StatefulTimer's milliseconds are too coarse for phases that take a few
+// hundred nanoseconds, so this uses the steady clock, in nanoseconds
+//
+// usage:
+//   LaunchProfile profile;
+//   profile.start();
+//   kernel->in(...); ...
+//   profile.stamp("apply3", "marshal");
+//   kernel->run_1d(...);
+//   profile.stamp("apply3", "run_1d");
+//   ...
+//   cout << profile.report();
+// each stamp records the time since the previous stamp, or since start(), so
+// the phases of a launch add up to its host time.  add() records durations
+// measured some other way, eg from event profiling
+
+class LaunchProfile {
+public:
+  static long long now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+  void start() {
+    last = now();
+  }
+  void stamp(std::string kernelName, std::string phase) {
+    long long time = now();
+    add(kernelName, phase, time - last);
+    last = time;
+  }
+  void add(std::string kernelName, std::string phase, long long nanoseconds) {
+    if(samples.find(kernelName) == samples.end()) {
+      kernelOrder.push_back(kernelName);
+    }
+    std::map<std::string, std::vector<long long> > &phases = samples[kernelName];
+    if(phases.find(phase) == phases.end()) {
+      phaseOrder[kernelName].push_back(phase);
+    }
+    phases[phase].push_back(nanoseconds);
+  }
+  void clear() {
+    samples.clear();
+    kernelOrder.clear();
+    phaseOrder.clear();
+  }
+  // one line per kernel and phase:
+  // launchprofile kernel=k phase=p n=.. p50=..us p99=..us max=..us mean=..us hist(us)=[lo,hi):count ...
+  std::string report(std::string prefix = "") {
+    std::ostringstream result;
+    for( int k = 0; k < (int)kernelOrder.size(); k++ ) {
+      std::string kernelName = kernelOrder[k];
+      for( int p = 0; p < (int)phaseOrder[kernelName].size(); p++ ) {
+        std::string phase = phaseOrder[kernelName][p];
+        std::vector<long long> sorted = samples[kernelName][phase];
+        std::sort(sorted.begin(), sorted.end());
+        int n = sorted.size();
+        double sum = 0;
+        for( int i = 0; i < n; i++ ) {
+          sum += sorted[i];
+        }
+        result << "launchprofile" << prefix << " kernel=" << kernelName << " phase=" << phase << " n=" << n
+          << " p50=" << percentile(sorted, 0.5) / 1000.0 << "us"
+          << " p99=" << percentile(sorted, 0.99) / 1000.0 << "us"
+          << " max=" << sorted[n - 1] / 1000.0 << "us"
+          << " mean=" << sum / n / 1000.0 << "us"
+          << " hist(us)=" << histogram(sorted) << std::endl;
+      }
+    }
+    return result.str();
+  }
+
+protected:
+  static long long percentile(const std::vector<long long> &sorted, double p) {
+    int rank = (int)(p * sorted.size() + 0.999999);
+    rank = std::max(1, std::min(rank, (int)sorted.size()));
+    return sorted[rank - 1];
+  }
+  // buckets [0,1) [1,2) [2,4) ... microseconds, only the non-empty ones
+  static std::string histogram(const std::vector<long long> &sorted) {
+    std::ostringstream result;
+    int i = 0;
+    long long low = 0;
+    long long high = 1000;
+    while(i < (int)sorted.size()) {
+      int count = 0;
+      while(i < (int)sorted.size() && sorted[i] < high) {
+        count++;
+        i++;
+      }
+      if(count > 0) {
+        result << (result.tellp() > 0 ? " " : "") << "[" << low / 1000 << "," << high / 1000 << "):" << count;
+      }
+      low = high;
+      high *= 2;
+    }
+    return result.str();
+  }
+
+  long long last;
+  std::vector<std::string> kernelOrder;
+  std::map<std::string, std::vector<std::string> > phaseOrder;
+  std::map<std::string, std::map<std::string, std::vector<long long> > > samples;
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <sys/resource.h>
+#include "EasyCL.h"
+
+// footprint accounting shared by the benchmarks: peak host RSS, bytes held on
+// the device through CLWrapper, and transfer volume in each direction
+//
+// EasyCL doesnt expose any hooks, so benchmarks call these instead of the
+// CLWrapper methods directly:
+//   memoryCopyToDevice(wrapper)    instead of wrapper->copyToDevice()
+//   memoryCreateOnDevice(wrapper)  instead of wrapper->createOnDevice()
+//   memoryCopyToHost(wrapper)      instead of wrapper->copyToHost()
+//   memoryDelete(wrapper)          instead of delete wrapper
+// then resetMemoryStats() at the start of each benchmark, and print
+// memoryString() at the end
+
+typedef struct MemoryStats {
+  double deviceBytes;
+  double peakDeviceBytes;
+  double hostToDeviceBytes;
+  double deviceToHostBytes;
+  std::set<CLWrapper *> onDevice;
+} MemoryStats;
+
+static MemoryStats memoryStats = { 0, 0, 0, 0, std::set<CLWrapper *>() };
+
+static inline double memoryWrapperBytes(CLWrapper *wrapper) {
+  return (double)wrapper->size() * wrapper->getElementSize();
+}
+
+static inline void memoryAllocated(CLWrapper *wrapper) {
+  if(memoryStats.onDevice.insert(wrapper).second) {
+    memoryStats.deviceBytes += memoryWrapperBytes(wrapper);
+    if(memoryStats.deviceBytes > memoryStats.peakDeviceBytes) {
+      memoryStats.peakDeviceBytes = memoryStats.deviceBytes;
+    }
+  }
+}
+
+static inline void memoryCopyToDevice(CLWrapper *wrapper) {
+  wrapper->copyToDevice();
+  memoryAllocated(wrapper);
+  memoryStats.hostToDeviceBytes += memoryWrapperBytes(wrapper);
+}
+
+static inline void memoryCreateOnDevice(CLWrapper *wrapper) {
+  wrapper->createOnDevice();
+  memoryAllocated(wrapper);
+}
+
+static inline void memoryCopyToHost(CLWrapper *wrapper) {
+  wrapper->copyToHost();
+  memoryStats.deviceToHostBytes += memoryWrapperBytes(wrapper);
+}
+
+static inline void memoryDelete(CLWrapper *wrapper) {
+  if(memoryStats.onDevice.erase(wrapper) > 0) {
+    memoryStats.deviceBytes -= memoryWrapperBytes(wrapper);
+  }
+  delete wrapper;
+}
+
+// for buffers and transfers made through the OpenCL api directly, eg where
+// sizes dont fit in CLWrapper's int
+static inline void memoryRawAllocated(double bytes) {
+  memoryStats.deviceBytes += bytes;
+  if(memoryStats.deviceBytes > memoryStats.peakDeviceBytes) {
+    memoryStats.peakDeviceBytes = memoryStats.deviceBytes;
+  }
+}
+
+static inline void memoryRawReleased(double bytes) {
+  memoryStats.deviceBytes -= bytes;
+}
+
+static inline void memoryRawCopied(double hostToDeviceBytes, double deviceToHostBytes) {
+  memoryStats.hostToDeviceBytes += hostToDeviceBytes;
+  memoryStats.deviceToHostBytes += deviceToHostBytes;
+}
+
+// VmHWM is the peak RSS, and on linux writing 5 to clear_refs resets it, so
+// we get a peak per benchmark, rather than per process.  elsewhere, fall back
+// to getrusage, which is per process
+static inline void resetMemoryStats() {
+  memoryStats.peakDeviceBytes = memoryStats.deviceBytes;
+  memoryStats.hostToDeviceBytes = 0;
+  memoryStats.deviceToHostBytes = 0;
+  std::ofstream clearRefs("/proc/self/clear_refs");
+  if(clearRefs) {
+    clearRefs << "5";
+  }
+}
+
+static inline double memoryPeakHostBytes() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while(std::getline(status, line)) {
+    if(line.compare(0, 6, "VmHWM:") == 0) {
+      return atof(line.substr(6).c_str()) * 1024;
+    }
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (double)usage.ru_maxrss * 1024;
+}
+
+static inline std::string memoryString() {
+  const double MB = 1024.0 * 1024.0;
+  std::ostringstream result;
+  result << " hostpeak=" << memoryPeakHostBytes() / MB << "MB"
+    << " devicepeak=" << memoryStats.peakDeviceBytes / MB << "MB"
+    << " h2d=" << memoryStats.hostToDeviceBytes / MB << "MB"
+    << " d2h=" << memoryStats.deviceToHostBytes / MB << "MB";
+  return result.str();
+}
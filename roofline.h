@@ -0,0 +1,93 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdlib>
+
+// shared by all the benchmarks: turns a time, plus the bytes moved and flops
+// done in that time, into GB/s and GFLOP/s, and, if test_stream has been run
+// for this gpu, into fractions of the attainable peaks it measured
+//
+// usage:
+//   in main: loadRooflinePeaks(gpu);
+//   in results: cout << ... << rooflineString(end - start, bytes, flops) << endl;
+// pass 0 flops where they cant be counted, and only GB/s is reported
+
+typedef struct RooflinePeaks {
+  bool loaded;
+  double copyGBs;
+  double scaleGBs;
+  double addGBs;
+  double triadGBs;
+  double gflops;
+} RooflinePeaks;
+
+static RooflinePeaks rooflinePeaks = { false, 0, 0, 0, 0, 0 };
+
+static inline std::string rooflinePeaksFilename(int gpu) {
+  std::ostringstream filename;
+  filename << "stream_peaks_gpu" << gpu << ".txt";
+  return filename.str();
+}
+
+static inline void loadRooflinePeaks(int gpu) {
+  std::string filename = rooflinePeaksFilename(gpu);
+  // so a run over several gpus doesnt keep the previous one's peaks
+  RooflinePeaks none = { false, 0, 0, 0, 0, 0 };
+  rooflinePeaks = none;
+  std::ifstream f(filename.c_str());
+  if(!f) {
+    std::cout << "no " << filename << ", run test_stream " << gpu << " to get peak fractions" << std::endl;
+    return;
+  }
+  std::string line;
+  while(std::getline(f, line)) {
+    size_t equals = line.find('=');
+    if(equals == std::string::npos) {
+      continue;
+    }
+    std::string key = line.substr(0, equals);
+    double value = atof(line.substr(equals + 1).c_str());
+    if(key == "copy") {
+      rooflinePeaks.copyGBs = value;
+    } else if(key == "scale") {
+      rooflinePeaks.scaleGBs = value;
+    } else if(key == "add") {
+      rooflinePeaks.addGBs = value;
+    } else if(key == "triad") {
+      rooflinePeaks.triadGBs = value;
+    } else if(key == "gflops") {
+      rooflinePeaks.gflops = value;
+    }
+  }
+  rooflinePeaks.loaded = true;
+}
+
+// attainable bandwidth is whichever stream kernel did best
+static inline double rooflinePeakGBs() {
+  double peak = rooflinePeaks.copyGBs;
+  if(rooflinePeaks.scaleGBs > peak) peak = rooflinePeaks.scaleGBs;
+  if(rooflinePeaks.addGBs > peak) peak = rooflinePeaks.addGBs;
+  if(rooflinePeaks.triadGBs > peak) peak = rooflinePeaks.triadGBs;
+  return peak;
+}
+
+static inline std::string rooflineString(double milliseconds, double bytes, double flops) {
+  double gbs = bytes / milliseconds / 1000.0 / 1000.0;
+  double gflops = flops / milliseconds / 1000.0 / 1000.0;
+  std::ostringstream result;
+  result << " GB/s=" << gbs;
+  if(rooflinePeaks.loaded && rooflinePeakGBs() > 0) {
+    result << " (" << (int)(gbs / rooflinePeakGBs() * 100) << "% of peak)";
+  }
+  if(flops <= 0) {
+    return result.str();
+  }
+  result << " GFLOP/s=" << gflops;
+  if(rooflinePeaks.loaded && rooflinePeaks.gflops > 0) {
+    result << " (" << (int)(gflops / rooflinePeaks.gflops * 100) << "% of peak)";
+  }
+  return result.str();
+}
@@ -3,6 +3,10 @@ using namespace std;
 #include "EasyCL.h"
 #include "util/StatefulTimer.h"
 #include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
 
 static const char *kernelSource = R"DELIM(
   kernel void test(int offset, int totalN, global float*out) {
@@ -14,6 +18,7 @@ static const char *kernelSource = R"DELIM(
 )DELIM";
 
 void test(EasyCL *cl, int numLaunches, int vectorSize, string operation = "+") {
+  resetMemoryStats();
   string arrayType = "float";
   if(vectorSize > 1) {
     arrayType += easycl::toString(vectorSize);
@@ -34,12 +39,14 @@ void test(EasyCL *cl, int numLaunches, int vectorSize, string operation = "+") {
       in[i] = inOut[i] = (i + 4) % 1000000;
   }
   CLWrapper *wrapper = cl->wrap(totalN, inOut);
-  wrapper->copyToDevice();
+  memoryCopyToDevice(wrapper);
 
   cl->finish();
   cl->dumpProfiling();
 
-  for(int it = 0; it < 3; it++) {
+  // capped at 30 samples, since each sample updates the tensor in place, and
+  // the reference has to replay them all
+  AdaptiveResult result = measureAdaptive([&]() {
     double start = StatefulTimer::instance()->getSystemMilliseconds();
     for( int i = 0; i < numLaunches; i++ ) {
       kernel->in(N * i / vectorSize);
@@ -48,35 +55,43 @@ void test(EasyCL *cl, int numLaunches, int vectorSize, string operation = "+") {
       kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
     }
     cl->finish();
-    double end = StatefulTimer::instance()->getSystemMilliseconds();
-    cl->dumpProfiling();
-  //  cout << "in[10]" << in[10] << endl;
-  //  cout << "Time, " << numLaunches << " launches: " << (end - start) << "ms" << endl;
-    cout << "it=" << it << " launches " << numLaunches << " N per launch " << N << " vectorsize=" << vectorSize << " op=" << operation << " time=" << (end - start) << "ms" << endl;
-    wrapper->copyToHost();
-    cl->finish();
-    int errorCount = 0;
-    if( operation == "+" ) {
-      for( int i = 0; i < totalN; i++ ) {
-        float targetValue = in[i] + 3.3f * (it + 1);
-        if(abs(inOut[i] - targetValue)> 0.1f) {
-          errorCount++;
-          if( errorCount < 20 ) {
-            cout << inOut[i] << " != " << targetValue << endl;
-            cout << abs(inOut[i] - targetValue) << endl;
-          }
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  }, 2.0, 5000, 3, 30);
+  cl->dumpProfiling();
+//  cout << "in[10]" << in[10] << endl;
+//  cout << "Time, " << numLaunches << " launches: " << (end - start) << "ms" << endl;
+  cout << "launches " << numLaunches << " N per launch " << N << " vectorsize=" << vectorSize << " op=" << operation << adaptiveString(result)
+    << rooflineString(result.median, (double)totalN * 2 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, templatedSource, "test", workgroupSize) << endl;
+  memoryCopyToHost(wrapper);
+  cl->finish();
+  int errorCount = 0;
+  if( operation == "+" ) {
+    int its = result.samples.size();
+    for( int i = 0; i < totalN; i++ ) {
+      float targetValue = in[i];
+      for( int it = 0; it < its; it++ ) {
+        targetValue += 3.3f;
+      }
+      if(abs(inOut[i] - targetValue)> 0.1f) {
+        errorCount++;
+        if( errorCount < 20 ) {
+          cout << inOut[i] << " != " << targetValue << endl;
+          cout << abs(inOut[i] - targetValue) << endl;
         }
       }
     }
-  //  cout << endl;
-    if( errorCount > 0 ) {
-      cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
-    } else {
-  //    cout << "No errors detected" << endl;
-    }
   }
+//  cout << endl;
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  } else {
+//    cout << "No errors detected" << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
 
-  delete wrapper;
+  memoryDelete(wrapper);
   delete[] in;
   delete[] inOut;
   delete kernel;
@@ -112,6 +127,7 @@ int main(int argc, char *argv[]) {
     gpu = atoi(argv[1]);
   }
   cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
   EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
   cl->setProfiling(true);
 //  testVectorSize(cl);
@@ -0,0 +1,248 @@
+#include <iostream>
+#include <cstring>
+#include <cmath>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "kernelresources.h"
+
+// as test_apply1, but with a choice of storage type:
+// - float: as test_apply1
+// - half: tensor stored as 16-bit floats, loaded with vload_half and stored with
+//   vstore_half, so arithmetic is still done in float.  this doesnt need
+//   cl_khr_fp16, just the core half load/store functions
+//
+// the kernels are memory-bound, one load and one store per element, so half
+// storage should approach 2x the elements/s, if the device can keep up with
+// the conversions
+//
+// values are kept small, since half tops out at 65504, and verification
+// allows for half's ~11 bits of mantissa
+
+static const char *floatSource = R"DELIM(
+  kernel void test(int offset, int totalN, global float*out) {
+    int linearId = get_global_id(0) + offset;
+    if(linearId < totalN) {
+      out[linearId] = out[linearId] {{operation}} 3.3f;
+    }
+  }
+)DELIM";
+
+static const char *halfSource = R"DELIM(
+  kernel void test(int offset, int totalN, global half*out) {
+    int linearId = get_global_id(0) + offset;
+    if(linearId < totalN) {
+      float{{vectorsuffix}} value = vload_half{{vectorsuffix}}(linearId, out);
+      vstore_half{{vectorsuffix}}(value {{operation}} 3.3f, linearId, out);
+    }
+  }
+)DELIM";
+
+// round to nearest even, as vstore_half does by default
+unsigned short floatToHalf(float value) {
+  unsigned int bits;
+  memcpy(&bits, &value, sizeof(bits));
+  unsigned int sign = (bits >> 16) & 0x8000;
+  int floatExponent = (bits >> 23) & 0xff;
+  int exponent = floatExponent - 127 + 15;
+  unsigned int mantissa = bits & 0x7fffff;
+  if(floatExponent == 0xff) {
+    return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+  }
+  if(exponent >= 31) {
+    return sign | 0x7c00;
+  }
+  if(exponent <= 0) {
+    if(exponent < -10) {
+      return sign;
+    }
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    unsigned int half = mantissa >> shift;
+    unsigned int remainder = mantissa & ((1u << shift) - 1);
+    unsigned int halfway = 1u << (shift - 1);
+    if(remainder > halfway || (remainder == halfway && (half & 1))) {
+      half++;
+    }
+    return sign | half;
+  }
+  unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+  unsigned int remainder = mantissa & 0x1fff;
+  if(remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+    half++; // carries into the exponent, and up to inf, as it should
+  }
+  return half;
+}
+
+float halfToFloat(unsigned short half) {
+  unsigned int sign = (half & 0x8000) << 16;
+  unsigned int exponent = (half >> 10) & 0x1f;
+  unsigned int mantissa = half & 0x3ff;
+  unsigned int bits;
+  if(exponent == 0) {
+    if(mantissa == 0) {
+      bits = sign;
+    } else {
+      exponent = 127 - 15 + 1;
+      while((mantissa & 0x400) == 0) {
+        mantissa <<= 1;
+        exponent--;
+      }
+      mantissa &= 0x3ff;
+      bits = sign | (exponent << 23) | (mantissa << 13);
+    }
+  } else if(exponent == 31) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else {
+    bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  }
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+float initialValue(int i) {
+  return ((i + 4) % 1000) / 10.0f;
+}
+
+float applyOperation(float value, string operation) {
+  if(operation == "+") {
+    return value + 3.3f;
+  } else if(operation == "*") {
+    return value * 3.3f;
+  } else {
+    return value / 3.3f;
+  }
+}
+
+void test(EasyCL *cl, bool halfStorage, int vectorSize, string operation = "+") {
+  resetMemoryStats();
+  int totalN = 128 * 1024 * 1024;
+  int numLaunches = 1;
+  int its = 3;
+  int N = totalN / numLaunches;
+  string templatedSource;
+  if(halfStorage) {
+    templatedSource = halfSource;
+    templatedSource = easycl::replaceGlobal(templatedSource, "{{vectorsuffix}}", vectorSize > 1 ? easycl::toString(vectorSize) : "");
+  } else {
+    string arrayType = "float";
+    if(vectorSize > 1) {
+      arrayType += easycl::toString(vectorSize);
+    }
+    templatedSource = easycl::replace(floatSource, "float", arrayType);
+  }
+  templatedSource = easycl::replace(templatedSource, "{{operation}}", operation);
+  CLKernel *kernel = cl->buildKernelFromString(templatedSource, "test", "");
+  const int workgroupSize = 64;
+  int numWorkgroups = (N / vectorSize + workgroupSize - 1) / workgroupSize;
+
+  int elementSize = halfStorage ? 2 : 4;
+  float *floatData = 0;
+  unsigned short *halfData = 0;
+  CLWrapper *wrapper = 0;
+  if(halfStorage) {
+    // no half wrapper in EasyCL, so wrap the halfs as half as many floats
+    halfData = new unsigned short[totalN];
+    for( int i = 0; i < totalN; i++ ) {
+      halfData[i] = floatToHalf(initialValue(i));
+    }
+    wrapper = cl->wrap(totalN / 2, reinterpret_cast<float *>(halfData));
+  } else {
+    floatData = new float[totalN];
+    for( int i = 0; i < totalN; i++ ) {
+      floatData[i] = initialValue(i);
+    }
+    wrapper = cl->wrap(totalN, floatData);
+  }
+  memoryCopyToDevice(wrapper);
+
+  cl->finish();
+  cl->dumpProfiling();
+
+  double start = StatefulTimer::instance()->getSystemMilliseconds();
+  for(int it = 0; it < its; it++) {
+    for( int i = 0; i < numLaunches; i++ ) {
+      kernel->in(N * i / vectorSize);
+      kernel->in(totalN / vectorSize);
+      kernel->inout(wrapper);
+      kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    }
+  }
+  cl->finish();
+  double end = StatefulTimer::instance()->getSystemMilliseconds();
+  cl->dumpProfiling();
+  double seconds = (end - start) / 1000.0;
+  double elementsPerSecond = (double)totalN * its / seconds;
+  cout << "storage=" << (halfStorage ? "half" : "float") << " vectorsize=" << vectorSize << " op=" << operation
+    << " its=" << its << " time=" << (end - start) << "ms"
+    << " elements/s=" << elementsPerSecond
+    << rooflineString(end - start, (double)totalN * its * elementSize * 2, (double)totalN * its)
+    << kernelResourceString(cl, templatedSource, "test", workgroupSize) << endl;
+  memoryCopyToHost(wrapper);
+  cl->finish();
+
+  // for half, the reference rounds to half after every iteration, same as the
+  // kernel does, so any remaining difference is rounding of the float math
+  int errorCount = 0;
+  for( int i = 0; i < totalN; i++ ) {
+    float targetValue = initialValue(i);
+    if(halfStorage) {
+      targetValue = halfToFloat(floatToHalf(targetValue));
+    }
+    for( int it = 0; it < its; it++ ) {
+      targetValue = applyOperation(targetValue, operation);
+      if(halfStorage) {
+        targetValue = halfToFloat(floatToHalf(targetValue));
+      }
+    }
+    float value = halfStorage ? halfToFloat(halfData[i]) : floatData[i];
+    float tolerance = halfStorage ? abs(targetValue) / 1024.0f : abs(targetValue) / 100000.0f;
+    if(abs(value - targetValue) > tolerance) {
+      errorCount++;
+      if( errorCount < 20 ) {
+        cout << value << " != " << targetValue << endl;
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(wrapper);
+  delete[] floatData;
+  delete[] halfData;
+  delete kernel;
+}
+
+void testStorage(EasyCL *cl) {
+  test(cl, false, 1, "+");
+  test(cl, true, 1, "+");
+  test(cl, false, 4, "+");
+  test(cl, true, 4, "+");
+  test(cl, false, 4, "*");
+  test(cl, true, 4, "*");
+  test(cl, false, 4, "/");
+  test(cl, true, 4, "/");
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  cl->setProfiling(true);
+  testStorage(cl);
+  cl->dumpProfiling();
+  delete cl;
+  return 0;
+}
+
@@ -3,6 +3,9 @@ using namespace std;
 #include "EasyCL.h"
 #include "util/StatefulTimer.h"
 #include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "kernelresources.h"
 
 static const char *kernelSource = R"DELIM(
   kernel void test(int offset, int totalN, global float*_out) {
@@ -15,6 +18,7 @@ static const char *kernelSource = R"DELIM(
 )DELIM";
 
 void test(EasyCL *cl, int numLaunches, int vectorSize, string operation = "+") {
+  resetMemoryStats();
   string arrayType = "float";
   if(vectorSize > 1) {
     arrayType += easycl::toString(vectorSize);
@@ -35,7 +39,7 @@ void test(EasyCL *cl, int numLaunches, int vectorSize, string operation = "+") {
       in[i] = inOut[i] = (i + 4) % 1000000;
   }
   CLWrapper *wrapper = cl->wrap(totalN, inOut);
-  wrapper->copyToDevice();
+  memoryCopyToDevice(wrapper);
 
   cl->finish();
   double start = StatefulTimer::instance()->getSystemMilliseconds();
@@ -48,10 +52,15 @@ void test(EasyCL *cl, int numLaunches, int vectorSize, string operation = "+") {
   }
   cl->finish();
   double end = StatefulTimer::instance()->getSystemMilliseconds();
-  wrapper->copyToHost();
+  memoryCopyToHost(wrapper);
 //  cout << "in[10]" << in[10] << endl;
 //  cout << "Time, " << numLaunches << " launches: " << (end - start) << "ms" << endl;
-  cout << "launches " << numLaunches << " N per launch " << N << " vectorsize=" << vectorSize << " op=" << operation << " time=" << (end - start) << "ms" << endl;
+  // one flop per element for the arithmetic operations; exp and tanh are many
+  // instructions, which differ by device, so for those only bandwidth is reported
+  double flops = operation.find('(') == string::npos ? (double)totalN : 0;
+  cout << "launches " << numLaunches << " N per launch " << N << " vectorsize=" << vectorSize << " op=" << operation << " time=" << (end - start) << "ms"
+    << rooflineString(end - start, (double)totalN * 2 * sizeof(float), flops)
+    << kernelResourceString(cl, templatedSource, "test", workgroupSize) << endl;
 
   int errorCount = 0;
   if( operation == "out + 3.3f" ) {
@@ -71,7 +80,9 @@ void test(EasyCL *cl, int numLaunches, int vectorSize, string operation = "+") {
 //    cout << "No errors detected" << endl;
   }
 
-  delete wrapper;
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(wrapper);
   delete[] in;
   delete[] inOut;
   delete kernel;
@@ -103,6 +114,7 @@ int main(int argc, char *argv[]) {
     gpu = atoi(argv[1]);
   }
   cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
   EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
 //  testVectorSize(cl);
   testOperations(cl);
@@ -3,6 +3,10 @@ using namespace std;
 #include "EasyCL.h"
 #include "util/StatefulTimer.h"
 #include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
 
 static const char *kernelSource = R"DELIM(
   kernel void test(int totalN, global float*out, global float *in1, global float *in2) {
@@ -13,7 +17,8 @@ static const char *kernelSource = R"DELIM(
   }
 )DELIM";
 
-void test(EasyCL *cl, int its, int size) {
+void test(EasyCL *cl, int size) {
+  resetMemoryStats();
   int totalN = size;
   string templatedSource = kernelSource;
   CLKernel *kernel = cl->buildKernelFromString(templatedSource, "test", "");
@@ -30,26 +35,31 @@ void test(EasyCL *cl, int its, int size) {
   CLWrapper *outwrap = cl->wrap(totalN, out);
   CLWrapper *in1wrap = cl->wrap(totalN, in1);
   CLWrapper *in2wrap = cl->wrap(totalN, in2);
-  in1wrap->copyToDevice();
-  in2wrap->copyToDevice();
-  outwrap->createOnDevice();
+  memoryCopyToDevice(in1wrap);
+  memoryCopyToDevice(in2wrap);
+  memoryCreateOnDevice(outwrap);
 
   cl->finish();
   cl->dumpProfiling();
 
-  double start = StatefulTimer::instance()->getSystemMilliseconds();
-  for(int it = 0; it < its; it++) {
-    kernel->in(totalN);
-    kernel->out(outwrap);
-    kernel->in(in1wrap);
-    kernel->in(in2wrap);
-    kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
-  }
-  cl->finish();
-  double end = StatefulTimer::instance()->getSystemMilliseconds();
+  // samples are per launch, batched and repeated until the median settles
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for(int it = 0; it < batchSize; it++) {
+      kernel->in(totalN);
+      kernel->out(outwrap);
+      kernel->in(in1wrap);
+      kernel->in(in2wrap);
+      kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    }
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
   cl->dumpProfiling();
-  cout << "its=" << its << " size=" << size << "time=" << (end - start) << "ms" << endl;
-  outwrap->copyToHost();
+  cout << "size=" << size << adaptiveString(result)
+    << rooflineString(result.median, (double)totalN * 3 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, templatedSource, "test", workgroupSize) << endl;
+  memoryCopyToHost(outwrap);
   cl->finish();
   int errorCount = 0;
   for( int i = 0; i < totalN; i++ ) {
@@ -68,9 +78,11 @@ void test(EasyCL *cl, int its, int size) {
   } else {
   }
 
-  delete outwrap;
-  delete in1wrap;
-  delete in2wrap;
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(outwrap);
+  memoryDelete(in1wrap);
+  memoryDelete(in2wrap);
   delete[] in1;
   delete[] in2;
   delete[] out;
@@ -83,10 +95,10 @@ int main(int argc, char *argv[]) {
     gpu = atoi(argv[1]);
   }
   cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
   EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
   cl->setProfiling(true);
-  test(cl, 900, 6400);
-  test(cl, 9000, 6400);
+  test(cl, 6400);
   cl->dumpProfiling();
   delete cl;
   return 0;
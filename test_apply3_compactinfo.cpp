@@ -0,0 +1,391 @@
+#include <iostream>
+#include <cmath>
+#include <vector>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// the Info struct in test_apply3_perclt is 48 bytes per tensor, whatever the
+// tensor, and the kernel reads it through global memory on every element.
+// this compares it against a compact, variable-length descriptor:
+//
+//   word 0: header: dims in bits 0-3, contiguous in bit 4, 64-bit offset in
+//           bit 5, 16-bit sizes and strides in bit 6
+//   offset: one word, or two, lo then hi, if it doesnt fit in 31 bits
+//   sizes then strides, only if not contiguous: packed two to a word as
+//           ushorts where every value fits, else one word each
+//
+// so a contiguous tensor is 8 bytes, and a 2-d strided one 16.  the three
+// descriptors are packed back to back, and each work item decodes them once,
+// into private variables, before indexing.  the compact kernel is built for
+// the largest dims among the operands, so the decode and index loops have a
+// fixed trip count, and can be unrolled into registers
+//
+// descriptors are either uploaded before every launch, as for a tensor whose
+// shape changes, with a non-blocking write, or uploaded once and reused
+//
+// cases, with in1 and in2 at small non-zero offsets in all of them:
+// - contiguous: 1-d, all three tensors contiguous
+// - transposed: 2-d, in1 read through a transposed view, ie strides (1, size0)
+// - wide: 2 x totalN/2, in1 a transposed view, so at 32M its size is past
+//   65535, and the descriptors are encoded with the 64-bit offset and 32-bit
+//   sizes and strides forced on, so those decode paths run at every size
+
+typedef struct Info {
+  int dims;
+  int offset;
+  int sizes[5];
+  int strides[5];
+} Info;
+
+static const char *kernelSource = R"DELIM(
+  typedef struct Info {
+    int dims;
+    int offset;
+    int sizes[5];
+    int strides[5];
+  } Info;
+
+  int infoOffset(global const struct Info *info, int linearId) {
+    int offset = info->offset;
+    for(int d = info->dims - 1; d >= 0; d--) {
+      int size = info->sizes[d];
+      offset += (linearId % size) * info->strides[d];
+      linearId /= size;
+    }
+    return offset;
+  }
+
+  kernel void info48(int totalN,
+      global const struct Info *infos,
+      global float*out_data,
+      global const float *in1_data,
+      global const float *in2_data
+      ) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out_data[infoOffset(&infos[0], linearId)] =
+        in1_data[infoOffset(&infos[1], linearId)] * in2_data[infoOffset(&infos[2], linearId)];
+    }
+  }
+
+  typedef struct Tensor {
+    int dims;
+    int contiguous;
+    long offset;
+    int sizes[MAX_DIMS];
+    int strides[MAX_DIMS];
+  } Tensor;
+
+  global const uint *decode(global const uint *desc, Tensor *tensor) {
+    uint header = desc[0];
+    tensor->dims = header & 15;
+    tensor->contiguous = (header >> 4) & 1;
+    desc++;
+    if((header >> 5) & 1) {
+      tensor->offset = (long)desc[0] | ((long)desc[1] << 32);
+      desc += 2;
+    } else {
+      tensor->offset = desc[0];
+      desc++;
+    }
+    if(!tensor->contiguous) {
+      if((header >> 6) & 1) {
+        global const ushort *narrow = (global const ushort *)desc;
+        for(int d = 0; d < MAX_DIMS; d++) {
+          if(d < tensor->dims) {
+            tensor->sizes[d] = narrow[d];
+            tensor->strides[d] = narrow[tensor->dims + d];
+          }
+        }
+        desc += tensor->dims;
+      } else {
+        for(int d = 0; d < MAX_DIMS; d++) {
+          if(d < tensor->dims) {
+            tensor->sizes[d] = desc[d];
+            tensor->strides[d] = desc[tensor->dims + d];
+          }
+        }
+        desc += 2 * tensor->dims;
+      }
+    }
+    return desc;
+  }
+
+  long tensorOffset(const Tensor *tensor, int linearId) {
+    if(tensor->contiguous) {
+      return tensor->offset + linearId;
+    }
+    long offset = tensor->offset;
+    for(int d = MAX_DIMS - 1; d >= 0; d--) {
+      if(d < tensor->dims) {
+        int size = tensor->sizes[d];
+        offset += (linearId % size) * tensor->strides[d];
+        linearId /= size;
+      }
+    }
+    return offset;
+  }
+
+  kernel void compact(int totalN,
+      global const uint *desc,
+      global float*out_data,
+      global const float *in1_data,
+      global const float *in2_data
+      ) {
+    Tensor out;
+    Tensor in1;
+    Tensor in2;
+    desc = decode(desc, &out);
+    desc = decode(desc, &in1);
+    decode(desc, &in2);
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out_data[tensorOffset(&out, linearId)] =
+        in1_data[tensorOffset(&in1, linearId)] * in2_data[tensorOffset(&in2, linearId)];
+    }
+  }
+)DELIM";
+
+typedef struct TensorView {
+  int dims;
+  long long offset;
+  int sizes[5];
+  int strides[5];
+} TensorView;
+
+TensorView makeView(int dims, const int *sizes, const int *strides, long long offset) {
+  TensorView view;
+  view.dims = dims;
+  view.offset = offset;
+  for( int d = 0; d < dims; d++ ) {
+    view.sizes[d] = sizes[d];
+    view.strides[d] = strides[d];
+  }
+  return view;
+}
+
+long long viewOffset(const TensorView &view, int linearId) {
+  long long offset = view.offset;
+  for( int d = view.dims - 1; d >= 0; d-- ) {
+    offset += (long long)(linearId % view.sizes[d]) * view.strides[d];
+    linearId /= view.sizes[d];
+  }
+  return offset;
+}
+
+Info toInfo(const TensorView &view) {
+  Info info;
+  info.dims = view.dims;
+  info.offset = (int)view.offset;
+  for( int d = 0; d < view.dims; d++ ) {
+    info.sizes[d] = view.sizes[d];
+    info.strides[d] = view.strides[d];
+  }
+  return info;
+}
+
+// forceWide sets the 64-bit offset and 32-bit sizes and strides, even where
+// the values would fit in less
+void encodeCompact(const TensorView &view, bool forceWide, vector<unsigned int> *desc) {
+  bool contiguous = true;
+  bool narrow = true;
+  int expectedStride = 1;
+  for( int d = view.dims - 1; d >= 0; d-- ) {
+    if(view.strides[d] != expectedStride) {
+      contiguous = false;
+    }
+    expectedStride *= view.sizes[d];
+    if(view.sizes[d] < 0 || view.sizes[d] > 65535 || view.strides[d] < 0 || view.strides[d] > 65535) {
+      narrow = false;
+    }
+  }
+  bool wideOffset = forceWide || view.offset >= (1ll << 31);
+  if(forceWide) {
+    narrow = false;
+  }
+  desc->push_back(view.dims | (contiguous ? 1 << 4 : 0) | (wideOffset ? 1 << 5 : 0) | (narrow ? 1 << 6 : 0));
+  desc->push_back((unsigned int)(view.offset & 0xffffffffll));
+  if(wideOffset) {
+    desc->push_back((unsigned int)(view.offset >> 32));
+  }
+  if(contiguous) {
+    return;
+  }
+  if(narrow) {
+    vector<unsigned short> halves;
+    for( int d = 0; d < view.dims; d++ ) {
+      halves.push_back(view.sizes[d]);
+    }
+    for( int d = 0; d < view.dims; d++ ) {
+      halves.push_back(view.strides[d]);
+    }
+    for( int i = 0; i < (int)halves.size(); i += 2 ) {
+      desc->push_back(halves[i] | ((unsigned int)halves[i + 1] << 16));
+    }
+  } else {
+    for( int d = 0; d < view.dims; d++ ) {
+      desc->push_back(view.sizes[d]);
+    }
+    for( int d = 0; d < view.dims; d++ ) {
+      desc->push_back(view.strides[d]);
+    }
+  }
+}
+
+void test(EasyCL *cl, int size, string testCase, string layout, bool perLaunchUpload) {
+  resetMemoryStats();
+  int totalN = size;
+  TensorView views[3];
+  int maxDims = 1;
+  const int in1Offset = 3;
+  const int in2Offset = 5;
+  int bufferN = totalN + in2Offset;
+  if(testCase == "contiguous") {
+    int sizes[] = { totalN };
+    int strides[] = { 1 };
+    views[0] = makeView(1, sizes, strides, 0);
+    views[1] = makeView(1, sizes, strides, in1Offset);
+    views[2] = makeView(1, sizes, strides, in2Offset);
+  } else {
+    int size0 = 2;
+    if(testCase == "transposed") {
+      size0 = (int)sqrt((double)totalN);
+      while(totalN % size0 != 0) {
+        size0--;
+      }
+    }
+    int sizes[] = { size0, totalN / size0 };
+    int strides[] = { totalN / size0, 1 };
+    int transposedStrides[] = { 1, size0 };
+    views[0] = makeView(2, sizes, strides, 0);
+    views[1] = makeView(2, sizes, transposedStrides, in1Offset);
+    views[2] = makeView(2, sizes, strides, in2Offset);
+    maxDims = 2;
+  }
+
+  string options = "-DMAX_DIMS=" + easycl::toString(maxDims);
+  CLKernel *kernel = cl->buildKernelFromString(kernelSource, layout, options);
+  const int workgroupSize = 64;
+  int numWorkgroups = (totalN + workgroupSize - 1) / workgroupSize;
+
+  float *out = new float[totalN];
+  float *in1 = new float[bufferN];
+  float *in2 = new float[bufferN];
+  for( int i = 0; i < bufferN; i++ ) {
+      in1[i] = (i + 4) % 1000000;
+      in2[i] = (i + 6) % 1000000;
+  }
+  CLWrapper *outwrap = cl->wrap(totalN, out);
+  CLWrapper *in1wrap = cl->wrap(bufferN, in1);
+  CLWrapper *in2wrap = cl->wrap(bufferN, in2);
+  memoryCopyToDevice(in1wrap);
+  memoryCopyToDevice(in2wrap);
+  memoryCreateOnDevice(outwrap);
+
+  Info infos[3];
+  vector<unsigned int> desc;
+  for( int t = 0; t < 3; t++ ) {
+    infos[t] = toInfo(views[t]);
+    encodeCompact(views[t], testCase == "wide", &desc);
+  }
+  CLWrapper *descwrap = 0;
+  int descriptorBytes = 0;
+  void *descHost = 0;
+  if(layout == "info48") {
+    descwrap = cl->wrap((sizeof(Info) * 3 + sizeof(float) - 1) / sizeof(float), reinterpret_cast<float *>(&infos[0]));
+    descriptorBytes = sizeof(Info) * 3;
+    descHost = &infos[0];
+  } else {
+    descwrap = cl->wrap((int)desc.size(), reinterpret_cast<int *>(&desc[0]));
+    descriptorBytes = desc.size() * sizeof(unsigned int);
+    descHost = &desc[0];
+  }
+  memoryCopyToDevice(descwrap);
+  cl_mem descBuffer = descwrap->getBuffer();
+  long long numUploads = 0;
+
+  cl->finish();
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for(int it = 0; it < batchSize; it++) {
+      if(perLaunchUpload) {
+        // CLWrapper's copyToDevice blocks, which would time a host sync
+        // rather than the upload
+        EasyCL::checkError(clEnqueueWriteBuffer(*cl->queue, descBuffer, CL_FALSE, 0, descriptorBytes, descHost, 0, 0, 0));
+        numUploads++;
+      }
+      kernel->in(totalN);
+      kernel->in(descwrap);
+      kernel->out(outwrap);
+      kernel->in(in1wrap);
+      kernel->in(in2wrap);
+      kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    }
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  memoryRawCopied((double)numUploads * descriptorBytes, 0);
+  cout << "compactinfo case=" << testCase << " size=" << size << " layout=" << layout
+    << " upload=" << (perLaunchUpload ? "perlaunch" : "cached") << " descriptorbytes=" << descriptorBytes
+    << adaptiveString(result)
+    << rooflineString(result.median, (double)totalN * 3 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, kernelSource, layout, workgroupSize, options) << endl;
+
+  memoryCopyToHost(outwrap);
+  int errorCount = 0;
+  for( int i = 0; i < totalN; i++ ) {
+    float targetValue = in1[viewOffset(views[1], i)] * in2[viewOffset(views[2], i)];
+    float value = out[viewOffset(views[0], i)];
+    if(abs(value - targetValue) > 0.1f) {
+      errorCount++;
+      if( errorCount < 20 ) {
+        cout << "out[" << i << "]=" << value << " != " << targetValue << endl;
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(descwrap);
+  memoryDelete(outwrap);
+  memoryDelete(in1wrap);
+  memoryDelete(in2wrap);
+  delete kernel;
+  delete[] out;
+  delete[] in1;
+  delete[] in2;
+}
+
+void testSize(EasyCL *cl, int size) {
+  string cases[] = { "contiguous", "transposed", "wide" };
+  string layouts[] = { "info48", "compact" };
+  for( int c = 0; c < 3; c++ ) {
+    for( int l = 0; l < 2; l++ ) {
+      test(cl, size, cases[c], layouts[l], true);
+      test(cl, size, cases[c], layouts[l], false);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  testSize(cl, 6400);
+  testSize(cl, 32 * 1024 * 1024);
+  delete cl;
+  return 0;
+}
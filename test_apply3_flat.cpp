@@ -5,6 +5,10 @@ using namespace std;
 #include "util/StatefulTimer.h"
 #include "util/easycl_stringhelper.h"
 #include "templates/TemplatedKernel.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
 
 static const char *kernelSource = R"DELIM(
   kernel void test(int totalN,
@@ -46,7 +50,8 @@ static const char *kernelSource = R"DELIM(
   }
 )DELIM";
 
-void test(EasyCL *cl, int its, int size, int numVirtualDims) {
+void test(EasyCL *cl, int size, int numVirtualDims) {
+  resetMemoryStats();
   int totalN = size;
   TemplatedKernel kernelBuilder(cl);
   kernelBuilder.set("numVirtualDims", numVirtualDims);
@@ -66,46 +71,54 @@ void test(EasyCL *cl, int its, int size, int numVirtualDims) {
   CLWrapper *outwrap = cl->wrap(totalN, out);
   CLWrapper *in1wrap = cl->wrap(totalN, in1);
   CLWrapper *in2wrap = cl->wrap(totalN, in2);
-  in1wrap->copyToDevice();
-  in2wrap->copyToDevice();
-  outwrap->createOnDevice();
+  memoryCopyToDevice(in1wrap);
+  memoryCopyToDevice(in2wrap);
+  memoryCreateOnDevice(outwrap);
 
   cl->finish();
   cl->dumpProfiling();
 
-  double start = StatefulTimer::instance()->getSystemMilliseconds();
-  for(int it = 0; it < its; it++) {
-    kernel->in(totalN);
+  // samples are per launch, batched and repeated until the median settles
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for(int it = 0; it < batchSize; it++) {
+      kernel->in(totalN);
 
-    kernel->in(0);
-    kernel->in(2);
-    for(int i = 0; i < numVirtualDims; i++ ) {
+      kernel->in(0);
       kernel->in(2);
+      for(int i = 0; i < numVirtualDims; i++ ) {
+        kernel->in(2);
+        kernel->in(2);
+      }
+      kernel->out(outwrap);
+      kernel->in(0);
       kernel->in(2);
-    }
-    kernel->out(outwrap);
-    kernel->in(0);
-    kernel->in(2);
-    for(int i = 0; i < numVirtualDims; i++ ) {
-      kernel->in(2);
-      kernel->in(2);
-    }
-    kernel->in(in1wrap);
-    kernel->in(0);
-    kernel->in(2);
-    for(int i = 0; i < numVirtualDims; i++ ) {
-      kernel->in(2);
+      for(int i = 0; i < numVirtualDims; i++ ) {
+        kernel->in(2);
+        kernel->in(2);
+      }
+      kernel->in(in1wrap);
+      kernel->in(0);
       kernel->in(2);
-    }
-    kernel->in(in2wrap);
+      for(int i = 0; i < numVirtualDims; i++ ) {
+        kernel->in(2);
+        kernel->in(2);
+      }
+      kernel->in(in2wrap);
 
-    kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
-  }
-  cl->finish();
-  double end = StatefulTimer::instance()->getSystemMilliseconds();
+      kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    }
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
   cl->dumpProfiling();
-  cout << "its=" << its << " size=" << size << " numVirtualDimensions=" << numVirtualDims << " time=" << (end - start) << "ms" << endl;
-  outwrap->copyToHost();
+  // per element, the multiply, plus six float adds per virtual dim, which are
+  // dependent, in source order, so the compiler cant fold them into one
+  double flopsPerElement = 1 + 6 * numVirtualDims;
+  cout << "size=" << size << " numVirtualDimensions=" << numVirtualDims << adaptiveString(result)
+    << rooflineString(result.median, (double)totalN * 3 * sizeof(float), (double)totalN * flopsPerElement)
+    << kernelResourceString(cl, kernelBuilder.getRenderedKernel(kernelSource), "test", workgroupSize) << endl;
+  memoryCopyToHost(outwrap);
   cl->finish();
   if(false){
   int errorCount = 0;
@@ -126,9 +139,11 @@ void test(EasyCL *cl, int its, int size, int numVirtualDims) {
   }
   }
 
-  delete outwrap;
-  delete in1wrap;
-  delete in2wrap;
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(outwrap);
+  memoryDelete(in1wrap);
+  memoryDelete(in2wrap);
   delete[] in1;
   delete[] in2;
   delete[] out;
@@ -141,21 +156,18 @@ int main(int argc, char *argv[]) {
     gpu = atoi(argv[1]);
   }
   cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
   EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
   cl->setProfiling(true);
-  for(int it = 0; it < 1; it++ ) {
-    int its = it == 1 ? 9000 : 900;
-    test(cl, its, 6400, 1);
-    test(cl, its, 6400, 2);
-    test(cl, its, 6400, 4);
-    test(cl, its, 6400, 5);
-    test(cl, its, 6400, 10);
-    test(cl, its, 6400, 15);
-    test(cl, its, 6400, 16);
-    test(cl, its, 6400, 20);
-    test(cl, its, 6400, 25);
-//  test(cl, 9000, 6400, 2);
-  }
+  test(cl, 6400, 1);
+  test(cl, 6400, 2);
+  test(cl, 6400, 4);
+  test(cl, 6400, 5);
+  test(cl, 6400, 10);
+  test(cl, 6400, 15);
+  test(cl, 6400, 16);
+  test(cl, 6400, 20);
+  test(cl, 6400, 25);
   cl->dumpProfiling();
   delete cl;
   return 0;
@@ -0,0 +1,223 @@
+#include <iostream>
+#include <cmath>
+#include <vector>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "templates/TemplatedKernel.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// the apply kernels declare their inputs as plain global float *, so the
+// compiler has to assume a store to out_data can change what in1_data and
+// in2_data point at, and cant use read-only load paths, eg nvidia's
+// ld.global.nc.  here apply3 is generated with its pointers qualified:
+// - plain: as test_apply3, no qualifiers
+// - const: const inputs, which is safe whatever aliases what, so is the
+//   fallback
+// - restrict: const restrict inputs, restrict output, which promises the
+//   output overlaps neither input
+//
+// restrict is only correct if it holds, so the host checks each input's
+// element range against the output's, and picks restrict when nothing
+// overlaps, and const otherwise.  inputs overlapping each other is fine,
+// since neither is written
+//
+// cases:
+// - distinct: three buffers
+// - samebuffer: in1 and in2 are the two halves of one buffer, as two
+//   narrow() views of one tensor would be, which doesnt overlap out
+// - inplace: out is in1, as x:cmul(y) is, so restrict isnt run.  in2 is all
+//   ones, so repeated launches leave out unchanged
+//
+// at 6400 elements, where launch overhead dominates, and 128M, where memory
+// bandwidth does.  with no gpu argument, runs on every gpu in turn
+
+static const char *kernelSource = R"DELIM(
+  kernel void test(int totalN,
+      int out_offset, global float *{{outRestrict}} out_data,
+      int in1_offset, global {{inConst}} float *{{inRestrict}} in1_data,
+      int in2_offset, global {{inConst}} float *{{inRestrict}} in2_data) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out_data[out_offset + linearId] = in1_data[in1_offset + linearId] * in2_data[in2_offset + linearId];
+    }
+  }
+)DELIM";
+
+typedef struct Operand {
+  CLWrapper *wrapper;
+  int offset;
+} Operand;
+
+// element ranges [offset, offset + totalN) in the same buffer
+bool overlaps(const Operand &a, const Operand &b, int totalN) {
+  return a.wrapper->getBuffer() == b.wrapper->getBuffer()
+    && a.offset < b.offset + totalN && b.offset < a.offset + totalN;
+}
+
+string selectQualifiers(const Operand &out, const Operand &in1, const Operand &in2, int totalN) {
+  if(overlaps(out, in1, totalN) || overlaps(out, in2, totalN)) {
+    return "const";
+  }
+  return "restrict";
+}
+
+void test(EasyCL *cl, int size, string testCase) {
+  resetMemoryStats();
+  int totalN = size;
+  cl_ulong maxAllocBytes = 0;
+  EasyCL::checkError(clGetDeviceInfo(cl->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAllocBytes), &maxAllocBytes, 0));
+  int largestBufferN = testCase == "samebuffer" ? 2 * totalN : totalN;
+  if((cl_ulong)largestBufferN * sizeof(float) > maxAllocBytes) {
+    cout << "apply3 restrict case=" << testCase << " size=" << size << " skipped, "
+      << largestBufferN * sizeof(float) / 1024 / 1024 << "MB buffer is over maxalloc="
+      << maxAllocBytes / 1024 / 1024 << "MB" << endl;
+    return;
+  }
+
+  float *out = new float[totalN];
+  float *in = new float[largestBufferN];
+  float *in2 = testCase == "samebuffer" ? in + totalN : new float[totalN];
+  for( int i = 0; i < totalN; i++ ) {
+      in[i] = (i + 4) % 1000000;
+      in2[i] = testCase == "inplace" ? 1.0f : (i + 6) % 1000000;
+  }
+  vector<CLWrapper *> wrappers;
+  Operand outOp, in1Op, in2Op;
+  if(testCase == "inplace") {
+    // out starts as in1's values
+    for( int i = 0; i < totalN; i++ ) {
+      out[i] = in[i];
+    }
+    outOp.wrapper = cl->wrap(totalN, out);
+    memoryCopyToDevice(outOp.wrapper);
+    in1Op.wrapper = outOp.wrapper;
+    in2Op.wrapper = cl->wrap(totalN, in2);
+    memoryCopyToDevice(in2Op.wrapper);
+    wrappers.push_back(outOp.wrapper);
+    wrappers.push_back(in2Op.wrapper);
+  } else {
+    outOp.wrapper = cl->wrap(totalN, out);
+    memoryCreateOnDevice(outOp.wrapper);
+    in1Op.wrapper = cl->wrap(largestBufferN, in);
+    memoryCopyToDevice(in1Op.wrapper);
+    wrappers.push_back(outOp.wrapper);
+    wrappers.push_back(in1Op.wrapper);
+    if(testCase == "samebuffer") {
+      in2Op.wrapper = in1Op.wrapper;
+    } else {
+      in2Op.wrapper = cl->wrap(totalN, in2);
+      memoryCopyToDevice(in2Op.wrapper);
+      wrappers.push_back(in2Op.wrapper);
+    }
+  }
+  outOp.offset = 0;
+  in1Op.offset = 0;
+  in2Op.offset = testCase == "samebuffer" ? totalN : 0;
+  string selected = selectQualifiers(outOp, in1Op, in2Op, totalN);
+
+  const int workgroupSize = 64;
+  int numWorkgroups = (totalN + workgroupSize - 1) / workgroupSize;
+  string variants[] = { "plain", "const", "restrict" };
+  for( int v = 0; v < 3; v++ ) {
+    string variant = variants[v];
+    if(variant == "restrict" && selected != "restrict") {
+      cout << "apply3 restrict case=" << testCase << " size=" << size << " variant=restrict skipped, out overlaps an input" << endl;
+      continue;
+    }
+    TemplatedKernel kernelBuilder(cl);
+    // restrict qualifies the pointer, so goes after the star
+    kernelBuilder.set("inConst", string(variant == "plain" ? "" : "const"));
+    kernelBuilder.set("inRestrict", string(variant == "restrict" ? "restrict" : ""));
+    kernelBuilder.set("outRestrict", string(variant == "restrict" ? "restrict" : ""));
+    CLKernel *kernel = kernelBuilder.buildKernel("apply3_restrict_" + variant, "apply3_restrict", kernelSource, "test");
+    cl->finish();
+    AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+      double start = StatefulTimer::instance()->getSystemMilliseconds();
+      for(int it = 0; it < batchSize; it++) {
+        kernel->in(totalN);
+        kernel->in(outOp.offset);
+        kernel->out(outOp.wrapper);
+        kernel->in(in1Op.offset);
+        kernel->in(in1Op.wrapper);
+        kernel->in(in2Op.offset);
+        kernel->in(in2Op.wrapper);
+        kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+      }
+      cl->finish();
+      return StatefulTimer::instance()->getSystemMilliseconds() - start;
+    });
+    cout << "apply3 restrict case=" << testCase << " size=" << size << " variant=" << variant
+      << (variant == selected ? " (selected)" : "")
+      << adaptiveString(result)
+      << rooflineString(result.median, (double)totalN * 3 * sizeof(float), (double)totalN)
+      << kernelResourceString(cl, kernelBuilder.getRenderedKernel(kernelSource), "test", workgroupSize) << endl;
+
+    memoryCopyToHost(outOp.wrapper);
+    int errorCount = 0;
+    for( int i = 0; i < totalN; i++ ) {
+      float targetValue = in[i] * in2[i];
+      if(abs(out[i] - targetValue) > 0.1f) {
+        errorCount++;
+        if( errorCount < 20 ) {
+          cout << "out[" << i << "]=" << out[i] << " != " << targetValue << endl;
+        }
+      }
+    }
+    if( errorCount > 0 ) {
+      cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+    }
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  for( int i = 0; i < (int)wrappers.size(); i++ ) {
+    memoryDelete(wrappers[i]);
+  }
+  if(testCase != "samebuffer") {
+    delete[] in2;
+  }
+  delete[] in;
+  delete[] out;
+}
+
+// gpus and accelerators, over all platforms, in the order createForIndexedGpu
+// numbers them
+int countGpus() {
+  int numGpus = 0;
+  cl_uint numPlatforms = 0;
+  EasyCL::checkError(clGetPlatformIDs(0, 0, &numPlatforms));
+  vector<cl_platform_id> platforms(numPlatforms);
+  EasyCL::checkError(clGetPlatformIDs(numPlatforms, &platforms[0], 0));
+  for( int p = 0; p < (int)numPlatforms; p++ ) {
+    cl_uint numDevices = 0;
+    if(clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR, 0, 0, &numDevices) == CL_SUCCESS) {
+      numGpus += numDevices;
+    }
+  }
+  return numGpus;
+}
+
+int main(int argc, char *argv[]) {
+  int firstGpu = 0;
+  int lastGpu = countGpus() - 1;
+  if( argc == 2 ) {
+    firstGpu = lastGpu = atoi(argv[1]);
+  }
+  string cases[] = { "distinct", "samebuffer", "inplace" };
+  for( int gpu = firstGpu; gpu <= lastGpu; gpu++ ) {
+    cout << "using gpu " << gpu << endl;
+    loadRooflinePeaks(gpu);
+    EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+    for( int c = 0; c < 3; c++ ) {
+      test(cl, 6400, cases[c]);
+      test(cl, 128 * 1024 * 1024, cases[c]);
+    }
+    delete cl;
+  }
+  return 0;
+}
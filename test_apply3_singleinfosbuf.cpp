@@ -4,6 +4,10 @@ using namespace std;
 #include "CLKernel_structs.h"
 #include "util/StatefulTimer.h"
 #include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
 
 typedef struct Info {
   int dims;
@@ -39,7 +43,8 @@ static const char *kernelSource = R"DELIM(
   }
 )DELIM";
 
-void test(EasyCL *cl, int its, int size, bool reuseStructBuffers) {
+void test(EasyCL *cl, int size, bool reuseStructBuffers) {
+  resetMemoryStats();
   int totalN = size;
   string templatedSource = kernelSource;
   CLKernel *kernel = cl->buildKernelFromString(templatedSource, "test", "");
@@ -56,9 +61,9 @@ void test(EasyCL *cl, int its, int size, bool reuseStructBuffers) {
   CLWrapper *outwrap = cl->wrap(totalN, out);
   CLWrapper *in1wrap = cl->wrap(totalN, in1);
   CLWrapper *in2wrap = cl->wrap(totalN, in2);
-  in1wrap->copyToDevice();
-  in2wrap->copyToDevice();
-  outwrap->createOnDevice();
+  memoryCopyToDevice(in1wrap);
+  memoryCopyToDevice(in2wrap);
+  memoryCreateOnDevice(outwrap);
 
   #define MAX_INFOS 128
   Info infos[MAX_INFOS];
@@ -72,7 +77,7 @@ void test(EasyCL *cl, int its, int size, bool reuseStructBuffers) {
 
   float *infosFloat = reinterpret_cast<float *>(&infos[0]);
   CLWrapper *infosWrap = cl->wrap((sizeof(Info)*3 + sizeof(float)-1)/sizeof(float), infosFloat);
-  infosWrap->copyToDevice();
+  memoryCopyToDevice(infosWrap);
 
   Info infosb[3];
   Info *outInfob = &infosb[0];
@@ -85,7 +90,7 @@ void test(EasyCL *cl, int its, int size, bool reuseStructBuffers) {
 
   float *infosFloatb = reinterpret_cast<float *>(&infosb[0]);
   CLWrapper *infosWrapb = cl->wrap((sizeof(Info)*3 + sizeof(float)-1)/sizeof(float), infosFloatb);
-  infosWrapb->copyToDevice();
+  memoryCopyToDevice(infosWrapb);
 
   typedef struct InfosStruct {
       Info infos[3];
@@ -104,7 +109,7 @@ void test(EasyCL *cl, int its, int size, bool reuseStructBuffers) {
       is->infos[i].strides[0] = 2; // just this last value will be different :-)
     }
     infosStruct->wrapper = cl->wrap((sizeof(Info)*3 + sizeof(float)-1)/sizeof(float), reinterpret_cast< float *>(&infosStruct->infos[0]));
-    infosStruct->wrapper->copyToDevice();
+    memoryCopyToDevice(infosStruct->wrapper);
     infosStore.push_back(infosStruct);
   }
   is = infosStore[59];
@@ -118,54 +123,59 @@ void test(EasyCL *cl, int its, int size, bool reuseStructBuffers) {
   cl->finish();
   cl->dumpProfiling();
 
-  double start = StatefulTimer::instance()->getSystemMilliseconds();
-  for(int it = 0; it < its; it++) {
-    kernel->in(totalN);
-
-    is = 0;
-    for( int i = 0; i < (int)infosStore.size(); i++ ) {
-      InfosStruct *tis = infosStore[i];
-      bool possiblematch = true;
-      for( int i = 0; i < 3; i++ ) {
-        if(tis->infos[i].offset != 0) {
-          possiblematch = false;
-          break;
-        }
-        if(tis->infos[i].dims != 1) {
-          possiblematch = false;
-          break;
+  // samples are per launch, batched and repeated until the median settles
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for(int it = 0; it < batchSize; it++) {
+      kernel->in(totalN);
+
+      is = 0;
+      for( int i = 0; i < (int)infosStore.size(); i++ ) {
+        InfosStruct *tis = infosStore[i];
+        bool possiblematch = true;
+        for( int i = 0; i < 3; i++ ) {
+          if(tis->infos[i].offset != 0) {
+            possiblematch = false;
+            break;
+          }
+          if(tis->infos[i].dims != 1) {
+            possiblematch = false;
+            break;
+          }
+          if(tis->infos[i].sizes[0] != 6400) {
+            possiblematch = false;
+            break;
+          }
+          if(tis->infos[i].strides[0] != 1) {
+            possiblematch = false;
+            break;
+          }
         }
-        if(tis->infos[i].sizes[0] != 6400) {
-          possiblematch = false;
-          break;
-        }
-        if(tis->infos[i].strides[0] != 1) {
-          possiblematch = false;
+        if(possiblematch) {
+          is = tis;
           break;
         }
       }
-      if(possiblematch) {
-        is = tis;
-        break;
+      if(is == 0) {
+        cout << "no mathcin is found" << endl;
       }
-    }
-    if(is == 0) {
-      cout << "no mathcin is found" << endl;
-    }
 
-    kernel->in(is->wrapper);
+      kernel->in(is->wrapper);
 
-    kernel->out(outwrap);
-    kernel->in(in1wrap);
-    kernel->in(in2wrap);
+      kernel->out(outwrap);
+      kernel->in(in1wrap);
+      kernel->in(in2wrap);
 
-    kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
-  }
-  cl->finish();
-  double end = StatefulTimer::instance()->getSystemMilliseconds();
+      kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    }
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
   cl->dumpProfiling();
-  cout << "its=" << its << " size=" << size << " reusestructbuffers=" << reuseStructBuffers << " time=" << (end - start) << "ms" << endl;
-  outwrap->copyToHost();
+  cout << "size=" << size << " reusestructbuffers=" << reuseStructBuffers << adaptiveString(result)
+    << rooflineString(result.median, (double)totalN * 3 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, templatedSource, "test", workgroupSize) << endl;
+  memoryCopyToHost(outwrap);
   cl->finish();
   int errorCount = 0;
   for( int i = 0; i < totalN; i++ ) {
@@ -184,9 +194,11 @@ void test(EasyCL *cl, int its, int size, bool reuseStructBuffers) {
   } else {
   }
 
-  delete outwrap;
-  delete in1wrap;
-  delete in2wrap;
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(outwrap);
+  memoryDelete(in1wrap);
+  memoryDelete(in2wrap);
   delete[] in1;
   delete[] in2;
   delete[] out;
@@ -199,10 +211,10 @@ int main(int argc, char *argv[]) {
     gpu = atoi(argv[1]);
   }
   cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
   EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
   cl->setProfiling(true);
-  test(cl, 900, 6400, true);
-  test(cl, 9000, 6400, true);
+  test(cl, 6400, true);
   cl->dumpProfiling();
   delete cl;
   return 0;
@@ -0,0 +1,244 @@
+#include <iostream>
+#include <cmath>
+#include <vector>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "templates/TemplatedKernel.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// applyN, for any number of operands, as lstm backward and fused gate
+// updates need 4 to 8.  operand 0 is written, the rest are read:
+//   op0 = 3.3f + op1 + op2 + ... + op{N-1}
+// each operand is a 2-d view, with an offset, and a size and stride per
+// dimension, which the kernel uses to find the element, as cutorch's apply
+// does
+//
+// how each operand's offset, sizes and strides reach the kernel:
+// - flat: as separate int kernel arguments, like test_apply3_flat, so
+//   argument count grows as N * (1 + 2 * dims)
+// - sharedbuf: all operands' metadata in one int buffer, uploaded once and
+//   reused, like test_apply3_singleinfosbuf, read through global memory
+// - specialized: baked into the kernel source as constants, so only the data
+//   pointers are passed, at the cost of one compile per distinct shape
+//
+// reports, per launch, the host time to enqueue, and the total including the
+// kernel, at 6400 elements, where launch overhead dominates, and at 4M, where
+// the kernel does
+
+static const char *kernelSource = R"DELIM(
+  {% for k=0,numOperands-1 do %}
+  {% if mode == "sharedbuf" then %}
+  #define op{{k}}_offset infos[{{k * (1 + 2 * dims)}}]
+  {% for d=0,dims-1 do %}
+  #define op{{k}}_size{{d}} infos[{{k * (1 + 2 * dims) + 1 + d}}]
+  #define op{{k}}_stride{{d}} infos[{{k * (1 + 2 * dims) + 1 + dims + d}}]
+  {% end %}
+  {% elseif mode == "specialized" then %}
+  #define op{{k}}_offset {{infos[k * (1 + 2 * dims) + 1]}}
+  {% for d=0,dims-1 do %}
+  #define op{{k}}_size{{d}} {{infos[k * (1 + 2 * dims) + 1 + 1 + d]}}
+  #define op{{k}}_stride{{d}} {{infos[k * (1 + 2 * dims) + 1 + 1 + dims + d]}}
+  {% end %}
+  {% end %}
+  {% end %}
+
+  kernel void test(int totalN,
+      {% if mode == "sharedbuf" then %}
+      global const int *infos,
+      {% end %}
+      {% for k=0,numOperands-1 do %}
+      {% if mode == "flat" then %}
+      int op{{k}}_offset,
+      {% for d=0,dims-1 do %}
+      int op{{k}}_size{{d}},
+      {% end %}
+      {% for d=0,dims-1 do %}
+      int op{{k}}_stride{{d}},
+      {% end %}
+      {% end %}
+      global float *op{{k}}_data{% if k < numOperands - 1 then %},{% end %}
+      {% end %}
+      ) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      {% for k=0,numOperands-1 do %}
+      int op{{k}}_index = op{{k}}_offset;
+      {
+        int remaining = linearId;
+        {% for d=dims-1,0,-1 do %}
+        op{{k}}_index += (remaining % op{{k}}_size{{d}}) * op{{k}}_stride{{d}};
+        {% if d > 0 then %}
+        remaining /= op{{k}}_size{{d}};
+        {% end %}
+        {% end %}
+      }
+      {% end %}
+      op0_data[op0_index] = 3.3f
+      {% for k=1,numOperands-1 do %}
+        + op{{k}}_data[op{{k}}_index]
+      {% end %}
+        ;
+    }
+  }
+)DELIM";
+
+void test(EasyCL *cl, int size, int numOperands, string mode) {
+  resetMemoryStats();
+  int totalN = size;
+  const int dims = 2;
+  const int size1 = 128;
+  int size0 = totalN / size1;
+  const int infoInts = 1 + 2 * dims;
+  // contiguous size0 x size1 views, at offset 0, except the last input, which
+  // is a transpose of a size1 x size0 tensor, at an offset, so that a mixed up
+  // offset, size or stride shows up as errors
+  const int transposedOffset = 7;
+  int transposed = numOperands > 1 ? numOperands - 1 : -1;
+  vector<int> infos(numOperands * infoInts);
+  vector<string> infoStrings;
+  for( int k = 0; k < numOperands; k++ ) {
+    int *info = &infos[k * infoInts];
+    info[0] = 0;
+    info[1] = size0;
+    info[2] = size1;
+    info[1 + dims] = size1;
+    info[2 + dims] = 1;
+    if(k == transposed) {
+      info[0] = transposedOffset;
+      info[1 + dims] = 1;
+      info[2 + dims] = size0;
+    }
+  }
+  for( int i = 0; i < (int)infos.size(); i++ ) {
+    infoStrings.push_back(easycl::toString(infos[i]));
+  }
+
+  TemplatedKernel kernelBuilder(cl);
+  kernelBuilder.set("numOperands", numOperands);
+  kernelBuilder.set("dims", dims);
+  kernelBuilder.set("mode", mode);
+  kernelBuilder.set("infos", infoStrings);
+//  cout << kernelBuilder.getRenderedKernel(kernelSource) << endl;
+  string uniqueName = "applyN_" + mode + "_" + easycl::toString(numOperands);
+  if(mode == "specialized") {
+    uniqueName += "_" + easycl::toString(size);
+  }
+  CLKernel *kernel = kernelBuilder.buildKernel(uniqueName, "applyN", kernelSource, "test");
+  const int workgroupSize = 64;
+  int numWorkgroups = (totalN + workgroupSize - 1) / workgroupSize;
+
+  vector<float *> data(numOperands);
+  vector<CLWrapper *> wrappers(numOperands);
+  for( int k = 0; k < numOperands; k++ ) {
+    int bufferN = k == transposed ? transposedOffset + totalN : totalN;
+    data[k] = new float[bufferN];
+    for( int i = 0; i < bufferN; i++ ) {
+      data[k][i] = (i + k) % 1000;
+    }
+    wrappers[k] = cl->wrap(bufferN, data[k]);
+    if(k == 0) {
+      memoryCreateOnDevice(wrappers[k]);
+    } else {
+      memoryCopyToDevice(wrappers[k]);
+    }
+  }
+  CLWrapper *infosWrap = cl->wrap((int)infos.size(), &infos[0]);
+  memoryCopyToDevice(infosWrap);
+
+  // metadata passed per launch, not counting the data pointers
+  int metadataBytes = 0;
+  if(mode == "flat") {
+    metadataBytes = numOperands * infoInts * sizeof(int);
+  } else if(mode == "sharedbuf") {
+    metadataBytes = sizeof(cl_mem);
+  }
+
+  cl->finish();
+  double enqueueMilliseconds = 0;
+  long long numLaunches = 0;
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for(int it = 0; it < batchSize; it++) {
+      kernel->in(totalN);
+      if(mode == "sharedbuf") {
+        kernel->in(infosWrap);
+      }
+      for( int k = 0; k < numOperands; k++ ) {
+        if(mode == "flat") {
+          for( int i = 0; i < infoInts; i++ ) {
+            kernel->in(infos[k * infoInts + i]);
+          }
+        }
+        if(k == 0) {
+          kernel->out(wrappers[k]);
+        } else {
+          kernel->in(wrappers[k]);
+        }
+      }
+      kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    }
+    enqueueMilliseconds += StatefulTimer::instance()->getSystemMilliseconds() - start;
+    numLaunches += batchSize;
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  cout << "applyN N=" << numOperands << " mode=" << mode << " size=" << size
+    << " metadatabytes=" << metadataBytes << adaptiveString(result)
+    << " enqueue/launch=" << enqueueMilliseconds / numLaunches << "ms"
+    << rooflineString(result.median, (double)totalN * numOperands * sizeof(float), (double)totalN * (numOperands - 1))
+    << kernelResourceString(cl, kernelBuilder.getRenderedKernel(kernelSource), "test", workgroupSize) << endl;
+
+  memoryCopyToHost(wrappers[0]);
+  int errorCount = 0;
+  for( int i = 0; i < totalN; i++ ) {
+    float targetValue = 3.3f;
+    for( int k = 1; k < numOperands; k++ ) {
+      if(k == transposed) {
+        targetValue += data[k][transposedOffset + (i / size1) + (i % size1) * size0];
+      } else {
+        targetValue += data[k][i];
+      }
+    }
+    if(abs(data[0][i] - targetValue) > 0.1f) {
+      errorCount++;
+      if( errorCount < 20 ) {
+        cout << "out[" << i << "]=" << data[0][i] << " != " << targetValue << endl;
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(infosWrap);
+  for( int k = 0; k < numOperands; k++ ) {
+    memoryDelete(wrappers[k]);
+    delete[] data[k];
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  string modes[] = { "flat", "sharedbuf", "specialized" };
+  for( int numOperands = 1; numOperands <= 8; numOperands++ ) {
+    for( int m = 0; m < 3; m++ ) {
+      test(cl, 6400, numOperands, modes[m]);
+      test(cl, 4 * 1024 * 1024, numOperands, modes[m]);
+    }
+  }
+  delete cl;
+  return 0;
+}
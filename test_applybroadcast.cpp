@@ -0,0 +1,274 @@
+#include <iostream>
+#include <cmath>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "templates/TemplatedKernel.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// broadcast apply, eg bias-add in char-rnn's linear layers, where one operand
+// has zero strides along some dimensions.  out is a contiguous {R, C} tensor,
+// and the broadcast operand, in2, is one of:
+// - row: size {C}, strides {0, 1}, ie same bias added to every row
+// - col: size {R}, strides {1, 0}, ie one value per row
+// - scalar: size {1}, strides {0, 0}
+//
+// apply2: out = out + in2
+// apply3: out = in1 + in2
+//
+// modes:
+// - generic: sizes and strides passed at runtime, div/mod per element, zero strides and all
+// - specialized: index for in2 is linearId % C, linearId / C, or 0, with C a compile-time constant
+// - local: as specialized, but the part of in2 that the workgroup touches is
+//   staged in __local memory first
+// - materialize: expand in2 to a full {R, C} tensor with one kernel, then run
+//   a plain contiguous apply against it, ie what you'd do without broadcast
+//   support.  both kernels are timed, since the bias changes every step
+
+static const char *kernelSource = R"DELIM(
+  #define SIZE1 {{size1}}
+
+  {% if mode == "materialize" then %}
+  kernel void expand(int totalN, global float *expanded, global const float *in2_data, int in2_stride0, int in2_stride1) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      int x1 = linearId % SIZE1;
+      int x0 = linearId / SIZE1;
+      expanded[linearId] = in2_data[x0 * in2_stride0 + x1 * in2_stride1];
+    }
+  }
+  {% end %}
+
+  kernel void test(int totalN,
+      int size1,
+      global float *out_data,
+      {% if apply3 == 1 then %}
+      global const float *in1_data,
+      {% end %}
+      global const float *in2_data,
+      int in2_stride0,
+      int in2_stride1
+      {% if mode == "local" then %}
+      , local float *in2_local
+      {% end %}
+      ) {
+    int linearId = get_global_id(0);
+    {% if mode == "local" and broadcast == "row" then %}
+    // just the slice of the row this group covers, wrapping at the row's end
+    int groupStart = get_group_id(0) * get_local_size(0);
+    in2_local[get_local_id(0)] = in2_data[(groupStart + get_local_id(0)) % SIZE1];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    {% elseif mode == "local" and broadcast == "col" then %}
+    int groupStart = get_group_id(0) * get_local_size(0);
+    int firstRow = groupStart / SIZE1;
+    int lastRow = min(groupStart + (int)get_local_size(0) - 1, totalN - 1) / SIZE1;
+    for(int i = get_local_id(0); i <= lastRow - firstRow; i += get_local_size(0)) {
+      in2_local[i] = in2_data[firstRow + i];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    {% end %}
+    if(linearId < totalN) {
+      {% if mode == "generic" then %}
+      int x1 = linearId % size1;
+      int x0 = linearId / size1;
+      float b = in2_data[x0 * in2_stride0 + x1 * in2_stride1];
+      {% elseif mode == "materialize" then %}
+      float b = in2_data[linearId];
+      {% elseif broadcast == "scalar" then %}
+      float b = in2_data[0];
+      {% elseif mode == "local" and broadcast == "row" then %}
+      float b = in2_local[linearId - groupStart];
+      {% elseif mode == "local" and broadcast == "col" then %}
+      float b = in2_local[linearId / SIZE1 - firstRow];
+      {% elseif broadcast == "row" then %}
+      float b = in2_data[linearId % SIZE1];
+      {% else %}
+      float b = in2_data[linearId / SIZE1];
+      {% end %}
+      {% if apply3 == 1 then %}
+      out_data[linearId] = in1_data[linearId] + b;
+      {% else %}
+      out_data[linearId] = out_data[linearId] + b;
+      {% end %}
+    }
+  }
+)DELIM";
+
+void test(EasyCL *cl, bool apply3, string broadcast, string mode, int size0, int size1) {
+  resetMemoryStats();
+  int totalN = size0 * size1;
+  int in2N = 1;
+  int in2Stride0 = 0;
+  int in2Stride1 = 0;
+  if(broadcast == "row") {
+    in2N = size1;
+    in2Stride1 = 1;
+  } else if(broadcast == "col") {
+    in2N = size0;
+    in2Stride0 = 1;
+  }
+
+  TemplatedKernel kernelBuilder(cl);
+  kernelBuilder.set("size1", size1);
+  kernelBuilder.set("apply3", apply3 ? 1 : 0);
+  kernelBuilder.set("broadcast", broadcast);
+  kernelBuilder.set("mode", mode);
+//  cout << kernelBuilder.getRenderedKernel(kernelSource) << endl;
+  string uniqueName = "applybroadcast_" + easycl::toString(apply3 ? 3 : 2) + "_" + broadcast + "_" + mode + "_" + easycl::toString(size1);
+  CLKernel *kernel = kernelBuilder.buildKernel(uniqueName, "applybroadcast", kernelSource, "test");
+  CLKernel *expandKernel = 0;
+  if(mode == "materialize") {
+    expandKernel = kernelBuilder.buildKernel(uniqueName + "_expand", "applybroadcast", kernelSource, "expand");
+  }
+  const int workgroupSize = 64;
+  int numWorkgroups = (totalN + workgroupSize - 1) / workgroupSize;
+  int localN = 0;
+  if(mode == "local") {
+    localN = broadcast == "row" ? workgroupSize : workgroupSize / size1 + 2;
+  }
+
+  float *out = new float[totalN];
+  float *in1 = new float[totalN];
+  float *in2 = new float[in2N];
+  for( int i = 0; i < totalN; i++ ) {
+    in1[i] = out[i] = (i + 4) % 1000;
+  }
+  for( int i = 0; i < in2N; i++ ) {
+    in2[i] = (i + 6) % 100 + 0.5f;
+  }
+  CLWrapper *outwrap = cl->wrap(totalN, out);
+  CLWrapper *in1wrap = cl->wrap(totalN, in1);
+  CLWrapper *in2wrap = cl->wrap(in2N, in2);
+  memoryCopyToDevice(outwrap);
+  memoryCopyToDevice(in1wrap);
+  memoryCopyToDevice(in2wrap);
+  float *expanded = 0;
+  CLWrapper *expandedwrap = 0;
+  if(mode == "materialize") {
+    expanded = new float[totalN];
+    expandedwrap = cl->wrap(totalN, expanded);
+    memoryCreateOnDevice(expandedwrap);
+  }
+
+  auto launch = [&]() {
+    CLWrapper *source = in2wrap;
+    if(mode == "materialize") {
+      expandKernel->in(totalN);
+      expandKernel->out(expandedwrap);
+      expandKernel->in(in2wrap);
+      expandKernel->in(in2Stride0);
+      expandKernel->in(in2Stride1);
+      expandKernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+      source = expandedwrap;
+    }
+    kernel->in(totalN);
+    kernel->in(size1);
+    kernel->inout(outwrap);
+    if(apply3) {
+      kernel->in(in1wrap);
+    }
+    kernel->in(source);
+    kernel->in(in2Stride0);
+    kernel->in(in2Stride1);
+    if(mode == "local") {
+      kernel->localFloats(localN);
+    }
+    kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+  };
+
+  cl->finish();
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for(int it = 0; it < batchSize; it++) {
+      launch();
+    }
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  // bytes actually needed: one full read and one full write, whether thats
+  // out and out, or in1 and out, plus the broadcast operand once
+  double bytes = (2 * (double)totalN + in2N) * sizeof(float);
+  cout << "apply" << (apply3 ? 3 : 2) << " broadcast=" << broadcast << " mode=" << mode
+    << " size=" << size0 << "x" << size1 << adaptiveString(result)
+    << rooflineString(result.median, bytes, (double)totalN);
+  string renderedSource = kernelBuilder.getRenderedKernel(kernelSource);
+  if(mode == "materialize") {
+    cout << kernelResourceString(cl, renderedSource, "expand", workgroupSize);
+  }
+  cout << kernelResourceString(cl, renderedSource, "test", workgroupSize) << endl;
+
+  // timing runs apply2 many times in place, so reset out, and check one launch
+  for( int i = 0; i < totalN; i++ ) {
+    out[i] = (i + 4) % 1000;
+  }
+  memoryCopyToDevice(outwrap);
+  launch();
+  cl->finish();
+  memoryCopyToHost(outwrap);
+  int errorCount = 0;
+  for( int i = 0; i < totalN; i++ ) {
+    int x1 = i % size1;
+    int x0 = i / size1;
+    float targetValue = in1[i] + in2[x0 * in2Stride0 + x1 * in2Stride1];
+    if(abs(out[i] - targetValue) > 0.001f) {
+      errorCount++;
+      if( errorCount < 20 ) {
+        cout << "out[" << i << "]=" << out[i] << " != " << targetValue << endl;
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(outwrap);
+  memoryDelete(in1wrap);
+  memoryDelete(in2wrap);
+  if(expandedwrap != 0) {
+    memoryDelete(expandedwrap);
+  }
+  delete[] out;
+  delete[] in1;
+  delete[] in2;
+  delete[] expanded;
+}
+
+void testBroadcast(EasyCL *cl, int size0, int size1) {
+  for( int a = 0; a < 2; a++ ) {
+    bool apply3 = a == 1;
+    test(cl, apply3, "row", "generic", size0, size1);
+    test(cl, apply3, "row", "specialized", size0, size1);
+    test(cl, apply3, "row", "local", size0, size1);
+    test(cl, apply3, "row", "materialize", size0, size1);
+    test(cl, apply3, "col", "generic", size0, size1);
+    test(cl, apply3, "col", "specialized", size0, size1);
+    test(cl, apply3, "col", "local", size0, size1);
+    test(cl, apply3, "col", "materialize", size0, size1);
+    test(cl, apply3, "scalar", "generic", size0, size1);
+    test(cl, apply3, "scalar", "specialized", size0, size1);
+    test(cl, apply3, "scalar", "materialize", size0, size1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  // char-rnn shapes: batch 50, gates 4 * rnn_size, then something big enough to be bandwidth bound
+  testBroadcast(cl, 50, 512);
+  testBroadcast(cl, 50, 2048);
+  testBroadcast(cl, 8192, 2048);
+  delete cl;
+  return 0;
+}
+
@@ -0,0 +1,139 @@
+#include <iostream>
+#include <cmath>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "templates/TemplatedKernel.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// persistent-thread, grid-stride apply: rather than one work item per
+// element, launch a fixed number of workgroups, a few per compute unit, and
+// have each work item loop over the tensor with a stride of the global size.
+// for small tensors, fewer fatter workgroups might cut scheduling overhead
+// and the tail where most of the device sits idle
+//
+// modes:
+// - peritem: one work item per element, as the other apply benchmarks
+// - gridstride: workgroupsPerCU * compute units workgroups, with the loop
+//   body unrolled 1, 2 or 4 times, then a remainder loop
+//
+// out = in + 3.3f, so each launch does the same thing, and the result can be
+// checked once at the end
+
+static const char *kernelSource = R"DELIM(
+  kernel void test(int totalN, global float *out, global const float *in) {
+    {% if mode == "peritem" then %}
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out[linearId] = in[linearId] + 3.3f;
+    }
+    {% else %}
+    int stride = get_global_size(0);
+    int linearId = get_global_id(0);
+    for(; linearId + {{unroll - 1}} * stride < totalN; linearId += {{unroll}} * stride) {
+      {% for u=0,unroll-1 do %}
+      out[linearId + {{u}} * stride] = in[linearId + {{u}} * stride] + 3.3f;
+      {% end %}
+    }
+    for(; linearId < totalN; linearId += stride) {
+      out[linearId] = in[linearId] + 3.3f;
+    }
+    {% end %}
+  }
+)DELIM";
+
+void test(EasyCL *cl, int totalN, string mode, int workgroupsPerCU = 0, int unroll = 1) {
+  resetMemoryStats();
+  TemplatedKernel kernelBuilder(cl);
+  kernelBuilder.set("mode", mode);
+  kernelBuilder.set("unroll", unroll);
+//  cout << kernelBuilder.getRenderedKernel(kernelSource) << endl;
+  CLKernel *kernel = kernelBuilder.buildKernel("applygridstride_" + mode + "_" + easycl::toString(unroll),
+    "applygridstride", kernelSource, "test");
+  const int workgroupSize = 64;
+  int numWorkgroups = (totalN + workgroupSize - 1) / workgroupSize;
+  if(mode == "gridstride") {
+    numWorkgroups = min(numWorkgroups, workgroupsPerCU * cl->getComputeUnits());
+  }
+
+  float *in = new float[totalN];
+  float *out = new float[totalN];
+  for( int i = 0; i < totalN; i++ ) {
+      in[i] = (i + 4) % 1000000;
+  }
+  CLWrapper *inwrap = cl->wrap(totalN, in);
+  CLWrapper *outwrap = cl->wrap(totalN, out);
+  memoryCopyToDevice(inwrap);
+  memoryCreateOnDevice(outwrap);
+
+  cl->finish();
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for(int it = 0; it < batchSize; it++) {
+      kernel->in(totalN);
+      kernel->out(outwrap);
+      kernel->in(inwrap);
+      kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    }
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  cout << "totalN=" << totalN << " mode=" << mode;
+  if(mode == "gridstride") {
+    cout << " workgroupspercu=" << workgroupsPerCU << " unroll=" << unroll;
+  }
+  cout << " workgroups=" << numWorkgroups << adaptiveString(result)
+    << rooflineString(result.median, (double)totalN * 2 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, kernelBuilder.getRenderedKernel(kernelSource), "test", workgroupSize) << endl;
+
+  memoryCopyToHost(outwrap);
+  int errorCount = 0;
+  for( int i = 0; i < totalN; i++ ) {
+    float targetValue = in[i] + 3.3f;
+    if(abs(out[i] - targetValue) > 0.1f) {
+      errorCount++;
+      if( errorCount < 20 ) {
+        cout << "out[" << i << "]=" << out[i] << " != " << targetValue << endl;
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(inwrap);
+  memoryDelete(outwrap);
+  delete[] in;
+  delete[] out;
+}
+
+void testSize(EasyCL *cl, int totalN) {
+  test(cl, totalN, "peritem");
+  for( int workgroupsPerCU = 1; workgroupsPerCU <= 16; workgroupsPerCU *= 2 ) {
+    for( int unroll = 1; unroll <= 4; unroll *= 2 ) {
+      test(cl, totalN, "gridstride", workgroupsPerCU, unroll);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  cout << "compute units " << cl->getComputeUnits() << endl;
+  testSize(cl, 6400);
+  testSize(cl, 128 * 1024 * 1024);
+  delete cl;
+  return 0;
+}
+
@@ -0,0 +1,236 @@
+#include <iostream>
+#include <cmath>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "templates/TemplatedKernel.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "kernelresources.h"
+
+// generic n-d apply has to turn linearId into coordinates, which costs one div
+// and one mod per dimension, per element:
+//   x{d} = rem % size{d}
+//   rem = rem / size{d}
+// here we compare three ways of doing that, for 1 to 8 dims:
+// - divmod: sizes read from Info at runtime, plain / and %
+// - magic: host precomputes a multiply-shift 'magic' pair for each size, and
+//   puts it into Info next to the size, then kernel does:
+//     q = (mul_hi(rem, magic) + rem) >> shift
+//     x = rem - q * size
+//   valid for rem < 2^31, which is all we can address with int anyway
+// - constant: sizes baked into the source as #defines, so the compiler does its
+//   own strength reduction
+//
+// the tensor is contiguous, so memory access is coalesced in all three cases,
+// and any difference comes from the index math
+
+#define MAX_DIMS 8
+
+typedef struct Info {
+  int dims;
+  int offset;
+  int sizes[MAX_DIMS];
+  int strides[MAX_DIMS];
+  unsigned int magics[MAX_DIMS];
+  unsigned int shifts[MAX_DIMS];
+} Info;
+
+static const char *kernelSource = R"DELIM(
+  #define MAX_DIMS 8
+  {{defines}}
+
+  typedef struct Info {
+    int dims;
+    int offset;
+    int sizes[MAX_DIMS];
+    int strides[MAX_DIMS];
+    unsigned int magics[MAX_DIMS];
+    unsigned int shifts[MAX_DIMS];
+  } Info;
+
+  kernel void test(int totalN, global struct Info *info, global float *out_data) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      unsigned int rem = linearId;
+      int offset = info->offset;
+      {% for d=dims-1,0,-1 do %}
+      {
+        {% if mode == "divmod" then %}
+        unsigned int size = info->sizes[{{d}}];
+        unsigned int q = rem / size;
+        unsigned int x = rem % size;
+        offset += x * info->strides[{{d}}];
+        {% elseif mode == "magic" then %}
+        unsigned int size = info->sizes[{{d}}];
+        unsigned int q = (mul_hi(rem, info->magics[{{d}}]) + rem) >> info->shifts[{{d}}];
+        unsigned int x = rem - q * size;
+        offset += x * info->strides[{{d}}];
+        {% else %}
+        unsigned int q = rem / SIZE{{d}};
+        unsigned int x = rem % SIZE{{d}};
+        offset += x * STRIDE{{d}};
+        {% end %}
+        rem = q;
+      }
+      {% end %}
+      out_data[offset] = out_data[offset] + 3.3f;
+    }
+  }
+)DELIM";
+
+// smallest shift with (1 << shift) >= divisor, and
+// magic = 2^32 * (2^shift - divisor) / divisor + 1
+// then for n < 2^31: n / divisor == (mul_hi(n, magic) + n) >> shift
+void computeMagic(unsigned int divisor, unsigned int *magic, unsigned int *shift) {
+  unsigned int s = 0;
+  while(s < 32 && (1ull << s) < divisor) {
+    s++;
+  }
+  unsigned long long m = ((1ull << 32) * ((1ull << s) - divisor)) / divisor + 1;
+  *magic = (unsigned int)m;
+  *shift = s;
+}
+
+unsigned int magicDivide(unsigned int n, unsigned int magic, unsigned int shift) {
+  unsigned int t = (unsigned int)(((unsigned long long)n * magic) >> 32);
+  return (t + n) >> shift;
+}
+
+int checkMagic(unsigned int divisor, unsigned int magic, unsigned int shift) {
+  int errorCount = 0;
+  unsigned int samples[] = { 0, 1, divisor - 1, divisor, divisor + 1, 2 * divisor - 1, 123456789, 0x7fffffff };
+  for( int i = 0; i < (int)(sizeof(samples) / sizeof(samples[0])); i++ ) {
+    unsigned int n = samples[i];
+    if(magicDivide(n, magic, shift) != n / divisor) {
+      errorCount++;
+      cout << "magic divide failed: " << n << " / " << divisor << " gave " << magicDivide(n, magic, shift) << endl;
+    }
+  }
+  return errorCount;
+}
+
+void test(EasyCL *cl, int its, int dims, string mode) {
+  resetMemoryStats();
+  // pick sizes that arent powers of two, so neither the compiler nor the
+  // hardware gets to cheat with a plain shift
+  const double targetN = 24.0 * 1000 * 1000;
+  Info info;
+  info.dims = dims;
+  info.offset = 0;
+  int size = (int)pow(targetN, 1.0 / dims);
+  if((size & (size - 1)) == 0) {
+    size++;
+  }
+  int totalN = 1;
+  for( int d = 0; d < dims; d++ ) {
+    info.sizes[d] = size;
+    totalN *= size;
+  }
+  int stride = 1;
+  for( int d = dims - 1; d >= 0; d-- ) {
+    info.strides[d] = stride;
+    stride *= info.sizes[d];
+  }
+  int magicErrorCount = 0;
+  for( int d = 0; d < dims; d++ ) {
+    computeMagic(info.sizes[d], &info.magics[d], &info.shifts[d]);
+    magicErrorCount += checkMagic(info.sizes[d], info.magics[d], info.shifts[d]);
+  }
+
+  string defines = "";
+  if(mode == "constant") {
+    for( int d = 0; d < dims; d++ ) {
+      defines += "#define SIZE" + easycl::toString(d) + " " + easycl::toString(info.sizes[d]) + "u\n";
+      defines += "  #define STRIDE" + easycl::toString(d) + " " + easycl::toString(info.strides[d]) + "\n  ";
+    }
+  }
+  TemplatedKernel kernelBuilder(cl);
+  kernelBuilder.set("dims", dims);
+  kernelBuilder.set("mode", mode);
+  kernelBuilder.set("defines", defines);
+//  cout << kernelBuilder.getRenderedKernel(kernelSource) << endl;
+  CLKernel *kernel = kernelBuilder.buildKernel( "applymagicdiv_" + mode + "_" + easycl::toString(dims) + "_" + easycl::toString(size),
+    "applymagicdiv", kernelSource, "test" );
+
+  const int workgroupSize = 64;
+  int numWorkgroups = (totalN + workgroupSize - 1) / workgroupSize;
+
+  float *in = new float[totalN];
+  float *inOut = new float[totalN];
+  for( int i = 0; i < totalN; i++ ) {
+      in[i] = inOut[i] = (i + 4) % 1000000;
+  }
+  CLWrapper *wrapper = cl->wrap(totalN, inOut);
+  memoryCopyToDevice(wrapper);
+
+  float *infoFloat = reinterpret_cast<float *>(&info);
+  CLWrapper *infoWrap = cl->wrap((sizeof(Info) + sizeof(float)-1)/sizeof(float), infoFloat);
+  memoryCopyToDevice(infoWrap);
+
+  cl->finish();
+  cl->dumpProfiling();
+
+  double start = StatefulTimer::instance()->getSystemMilliseconds();
+  for(int it = 0; it < its; it++) {
+    kernel->in(totalN);
+    kernel->in(infoWrap);
+    kernel->inout(wrapper);
+    kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+  }
+  cl->finish();
+  double end = StatefulTimer::instance()->getSystemMilliseconds();
+  cl->dumpProfiling();
+  cout << "its=" << its << " dims=" << dims << " size=" << size << " totalN=" << totalN << " mode=" << mode << " time=" << (end - start) << "ms"
+    << rooflineString(end - start, (double)its * totalN * 2 * sizeof(float), (double)its * totalN)
+    << kernelResourceString(cl, kernelBuilder.getRenderedKernel(kernelSource), "test", workgroupSize) << endl;
+  memoryCopyToHost(wrapper);
+  cl->finish();
+
+  // a bad magic pair counts too, even if this run's indices dont hit it
+  int errorCount = magicErrorCount;
+  for( int i = 0; i < totalN; i++ ) {
+    float targetValue = in[i];
+    for( int it = 0; it < its; it++ ) {
+      targetValue += 3.3f;
+    }
+    if(abs(inOut[i] - targetValue) > 0.1f) {
+      errorCount++;
+      if( errorCount < 20 ) {
+        cout << "out[" << i << "]=" << inOut[i] << " != " << targetValue << endl;
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(infoWrap);
+  memoryDelete(wrapper);
+  delete[] in;
+  delete[] inOut;
+//  delete kernel;
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  cl->setProfiling(true);
+  for( int dims = 1; dims <= MAX_DIMS; dims++ ) {
+    test(cl, 10, dims, "divmod");
+    test(cl, 10, dims, "magic");
+    test(cl, 10, dims, "constant");
+  }
+  cl->dumpProfiling();
+  delete cl;
+  return 0;
+}
+
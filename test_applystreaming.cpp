@@ -0,0 +1,283 @@
+#include <iostream>
+#include <unistd.h>
+#include <cstring>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// out-of-core apply: host tensor of any size, up to 64-bit element counts,
+// run through the device a chunk at a time, adding 1 to each element, as
+// test_launch does
+//
+// modes:
+// - incore: whole tensor on the device: copy up, one kernel, copy down.  only
+//   for sizes that fit in one allocation.  reported both with and without the
+//   transfers
+// - serial: one device buffer and one queue, so each chunk is uploaded,
+//   computed and downloaded before the next starts
+// - double, triple: two or three device buffers, and separate upload, compute
+//   and download queues, chained with events, so chunk c + 1 uploads while c
+//   computes and c - 1 downloads, with each buffer reused once its download is
+//   done
+//
+// drivers copy from pageable memory synchronously, through a bounce buffer,
+// so the streaming modes stage each chunk through a pinned
+// CL_MEM_ALLOC_HOST_PTR buffer per slot, mapped once, and memcpy between it
+// and the host tensor: in before the upload, and out once the download's
+// event completes, just before the slot is reused
+//
+// CLWrapper sizes are int, and its copies block, so this uses the OpenCL api
+// directly.  chunks are int-sized, only the totals and host offsets are 64-bit
+
+static const char *kernelSource = R"DELIM(
+  kernel void test(int N, global float *out) {
+    int linearId = get_global_id(0);
+    if(linearId < N) {
+      out[linearId] = out[linearId] + 1.0f;
+    }
+  }
+)DELIM";
+
+// elements per ms of the last incore run, to compare streaming against
+static double incoreElementsPerMs = 0;
+
+cl_kernel buildRawKernel(EasyCL *cl, cl_program *program) {
+  cl_int err;
+  const char *source = kernelSource;
+  *program = clCreateProgramWithSource(*cl->context, 1, &source, 0, &err);
+  EasyCL::checkError(err);
+  EasyCL::checkError(clBuildProgram(*program, 1, &cl->device, "", 0, 0));
+  cl_kernel kernel = clCreateKernel(*program, "test", &err);
+  EasyCL::checkError(err);
+  return kernel;
+}
+
+void enqueueChunk(cl_command_queue queue, cl_kernel kernel, cl_mem buffer, int N, cl_uint numWaits, cl_event *waits, cl_event *done) {
+  const int workgroupSize = 64;
+  size_t global = ((N + workgroupSize - 1) / workgroupSize) * workgroupSize;
+  size_t local = workgroupSize;
+  EasyCL::checkError(clSetKernelArg(kernel, 0, sizeof(N), &N));
+  EasyCL::checkError(clSetKernelArg(kernel, 1, sizeof(buffer), &buffer));
+  EasyCL::checkError(clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global, &local, numWaits, waits, done));
+}
+
+// copies a finished chunk's result from its staging slot back into the host
+// tensor
+void drainSlot(cl_event *downloaded, float *staging, float *host, long long start, int N) {
+  EasyCL::checkError(clWaitForEvents(1, downloaded));
+  clReleaseEvent(*downloaded);
+  *downloaded = 0;
+  memcpy(host + start, staging, (size_t)N * sizeof(float));
+}
+
+// one pass over the whole host tensor
+void streamApply(cl_kernel kernel, cl_command_queue *queues, cl_mem *buffers, float **staging, int numBuffers,
+    float *host, long long totalN, int chunkN) {
+  cl_command_queue upload = queues[0];
+  cl_command_queue compute = queues[1];
+  cl_command_queue download = queues[2];
+  vector<cl_event> downloaded(numBuffers, (cl_event)0);
+  vector<long long> slotStart(numBuffers, 0);
+  vector<int> slotN(numBuffers, 0);
+  for( long long start = 0, chunk = 0; start < totalN; start += chunkN, chunk++ ) {
+    int slot = chunk % numBuffers;
+    int N = (int)min((long long)chunkN, totalN - start);
+    size_t bytes = (size_t)N * sizeof(float);
+    // the slot's staging memory is free once its last download is done
+    if(downloaded[slot] != 0) {
+      drainSlot(&downloaded[slot], staging[slot], host, slotStart[slot], slotN[slot]);
+    }
+    memcpy(staging[slot], host + start, bytes);
+    cl_event uploaded;
+    cl_event computed;
+    EasyCL::checkError(clEnqueueWriteBuffer(upload, buffers[slot], CL_FALSE, 0, bytes, staging[slot],
+      0, 0, &uploaded));
+    enqueueChunk(compute, kernel, buffers[slot], N, 1, &uploaded, &computed);
+    EasyCL::checkError(clEnqueueReadBuffer(download, buffers[slot], CL_FALSE, 0, bytes, staging[slot],
+      1, &computed, &downloaded[slot]));
+    slotStart[slot] = start;
+    slotN[slot] = N;
+    clReleaseEvent(uploaded);
+    clReleaseEvent(computed);
+    // keep the upload queue moving, some drivers dont start work until flushed
+    clFlush(upload);
+    clFlush(compute);
+    clFlush(download);
+  }
+  for( int slot = 0; slot < numBuffers; slot++ ) {
+    if(downloaded[slot] != 0) {
+      drainSlot(&downloaded[slot], staging[slot], host, slotStart[slot], slotN[slot]);
+    }
+  }
+  for( int i = 0; i < 3; i++ ) {
+    clFinish(queues[i]);
+  }
+}
+
+void test(EasyCL *cl, long long totalN, int chunkN, string mode) {
+  resetMemoryStats();
+  cl_program program;
+  cl_kernel kernel = buildRawKernel(cl, &program);
+  cl_int err;
+
+  float *host = new float[totalN];
+  for( long long i = 0; i < totalN; i++ ) {
+    host[i] = i % 1000;
+  }
+
+  int numBuffers = 1;
+  if(mode == "double") {
+    numBuffers = 2;
+  } else if(mode == "triple") {
+    numBuffers = 3;
+  }
+  size_t bufferBytes = (size_t)chunkN * sizeof(float);
+  if(mode == "incore") {
+    bufferBytes = (size_t)totalN * sizeof(float);
+  }
+  vector<cl_mem> buffers(numBuffers);
+  for( int i = 0; i < numBuffers; i++ ) {
+    buffers[i] = clCreateBuffer(*cl->context, CL_MEM_READ_WRITE, bufferBytes, 0, &err);
+    EasyCL::checkError(err);
+    memoryRawAllocated(bufferBytes);
+  }
+  // pinned staging, one per slot, mapped once for the whole run
+  vector<cl_mem> stagingBuffers;
+  vector<float *> staging;
+  if(mode != "incore") {
+    for( int i = 0; i < numBuffers; i++ ) {
+      stagingBuffers.push_back(clCreateBuffer(*cl->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bufferBytes, 0, &err));
+      EasyCL::checkError(err);
+      memoryRawAllocated(bufferBytes);
+      staging.push_back((float *)clEnqueueMapBuffer(*cl->queue, stagingBuffers[i], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+        0, bufferBytes, 0, 0, 0, &err));
+      EasyCL::checkError(err);
+    }
+  }
+  cl_command_queue queues[3];
+  for( int i = 0; i < 3; i++ ) {
+    queues[i] = *cl->queue;
+    if(numBuffers > 1) {
+      queues[i] = clCreateCommandQueue(*cl->context, cl->device, 0, &err);
+      EasyCL::checkError(err);
+    }
+  }
+
+  double kernelMilliseconds = 0;
+  int numSamples = 0;
+  // each sample streams the whole tensor, which can be many seconds, so
+  // settle for fewer samples than usual
+  AdaptiveResult result = measureAdaptive([&]() {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    if(mode == "incore") {
+      EasyCL::checkError(clEnqueueWriteBuffer(*cl->queue, buffers[0], CL_TRUE, 0, bufferBytes, host, 0, 0, 0));
+      double kernelStart = StatefulTimer::instance()->getSystemMilliseconds();
+      enqueueChunk(*cl->queue, kernel, buffers[0], (int)totalN, 0, 0, 0);
+      clFinish(*cl->queue);
+      kernelMilliseconds += StatefulTimer::instance()->getSystemMilliseconds() - kernelStart;
+      EasyCL::checkError(clEnqueueReadBuffer(*cl->queue, buffers[0], CL_TRUE, 0, bufferBytes, host, 0, 0, 0));
+    } else {
+      streamApply(kernel, queues, &buffers[0], &staging[0], numBuffers, host, totalN, chunkN);
+    }
+    numSamples++;
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  }, 2.0, 5000, 3, 20);
+  memoryRawCopied((double)numSamples * totalN * sizeof(float), (double)numSamples * totalN * sizeof(float));
+
+  double elementsPerMs = totalN / result.median;
+  cout << "streaming totalN=" << totalN << " mode=" << mode;
+  if(mode != "incore") {
+    cout << " chunkN=" << chunkN << " chunks=" << (totalN + chunkN - 1) / chunkN;
+  }
+  cout << adaptiveString(result) << " elements/s=" << elementsPerMs * 1000;
+  if(mode == "incore") {
+    cout << " kernelonly=" << kernelMilliseconds / numSamples << "ms";
+    incoreElementsPerMs = elementsPerMs;
+  } else if(incoreElementsPerMs > 0) {
+    cout << " vsincore=" << (int)(elementsPerMs / incoreElementsPerMs * 100) << "%";
+  }
+  cout << rooflineString(result.median, (double)totalN * 2 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, kernel, 64) << endl;
+
+  long long errorCount = 0;
+  for( long long i = 0; i < totalN; i++ ) {
+    float targetValue = i % 1000 + numSamples;
+    if(host[i] != targetValue) {
+      errorCount++;
+      if( errorCount < 20 ) {
+        cout << "host[" << i << "]=" << host[i] << " != " << targetValue << endl;
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  if(numBuffers > 1) {
+    for( int i = 0; i < 3; i++ ) {
+      clReleaseCommandQueue(queues[i]);
+    }
+  }
+  for( int i = 0; i < (int)stagingBuffers.size(); i++ ) {
+    EasyCL::checkError(clEnqueueUnmapMemObject(*cl->queue, stagingBuffers[i], staging[i], 0, 0, 0));
+  }
+  clFinish(*cl->queue);
+  for( int i = 0; i < (int)stagingBuffers.size(); i++ ) {
+    clReleaseMemObject(stagingBuffers[i]);
+    memoryRawReleased(bufferBytes);
+  }
+  for( int i = 0; i < numBuffers; i++ ) {
+    clReleaseMemObject(buffers[i]);
+    memoryRawReleased(bufferBytes);
+  }
+  clReleaseKernel(kernel);
+  clReleaseProgram(program);
+  delete[] host;
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+
+  cl_ulong maxAllocBytes = 0;
+  EasyCL::checkError(clGetDeviceInfo(cl->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAllocBytes), &maxAllocBytes, 0));
+  double hostBytes = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE);
+  cout << "max alloc " << maxAllocBytes / 1024 / 1024 << "MB host memory " << (long long)(hostBytes / 1024 / 1024) << "MB" << endl;
+
+  // 256M floats is where test_launch stops; 2.5G floats is past int
+  const long long sizes[] = { 64ll << 20, 256ll << 20, 1024ll << 20, 2560ll << 20 };
+  for( int s = 0; s < 4; s++ ) {
+    long long totalN = sizes[s];
+    double bytes = (double)totalN * sizeof(float);
+    if(bytes > hostBytes / 2) {
+      cout << "skipping totalN=" << totalN << ", needs " << (long long)(bytes / 1024 / 1024) << "MB of host memory" << endl;
+      continue;
+    }
+    if(bytes <= maxAllocBytes && totalN < (1ll << 31)) {
+      test(cl, totalN, 0, "incore");
+    }
+    for( int chunkN = 4 << 20; chunkN <= 64 << 20; chunkN *= 4 ) {
+      if((double)chunkN * sizeof(float) > maxAllocBytes) {
+        continue;
+      }
+      test(cl, totalN, chunkN, "serial");
+      test(cl, totalN, chunkN, "double");
+      test(cl, totalN, chunkN, "triple");
+    }
+  }
+  delete cl;
+  return 0;
+}
+
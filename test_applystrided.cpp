@@ -3,6 +3,9 @@ using namespace std;
 #include "EasyCL.h"
 #include "util/StatefulTimer.h"
 #include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "kernelresources.h"
 
 // let's imagine we have a 32x32 transposed matrix
 // now of course, we could still process in memory order, but on apply2,
@@ -92,6 +95,7 @@ string boolToString(bool value) {
 }
 
 void test(EasyCL *cl, int vectorSize, bool transposed=false, int size1=32) {
+  resetMemoryStats();
   string arrayType = "float";
   if(vectorSize > 1) {
     arrayType += easycl::toString(vectorSize);
@@ -124,7 +128,7 @@ void test(EasyCL *cl, int vectorSize, bool transposed=false, int size1=32) {
       in[i] = inOut[i] = (i + 4) % 1000000;
   }
   CLWrapper *wrapper = cl->wrap(totalN, inOut);
-  wrapper->copyToDevice();
+  memoryCopyToDevice(wrapper);
 
   cl->finish();
   cl->dumpProfiling();
@@ -137,11 +141,13 @@ void test(EasyCL *cl, int vectorSize, bool transposed=false, int size1=32) {
   cl->finish();
   double end = StatefulTimer::instance()->getSystemMilliseconds();
   cl->dumpProfiling();
-  wrapper->copyToHost();
+  memoryCopyToHost(wrapper);
   cl->finish();
 //  cout << "in[10]" << in[10] << endl;
 //  cout << "Time, " << numLaunches << " launches: " << (end - start) << "ms" << endl;
-  cout << "vectorsize=" << vectorSize << " t=" << transposed << " size1=" << size1 << " time=" << (end - start) << "ms" << endl;
+  cout << "vectorsize=" << vectorSize << " t=" << transposed << " size1=" << size1 << " time=" << (end - start) << "ms"
+    << rooflineString(end - start, (double)totalN * 2 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, templatedSource, "test", workgroupSize) << endl;
 
   int errorCount = 0;
   for( int i = 0; i < totalN; i++ ) {
@@ -159,7 +165,9 @@ void test(EasyCL *cl, int vectorSize, bool transposed=false, int size1=32) {
 //    cout << "No errors detected" << endl;
   }
 
-  delete wrapper;
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(wrapper);
   delete[] in;
   delete[] inOut;
   delete kernel;
@@ -182,6 +190,7 @@ int main(int argc, char *argv[]) {
     gpu = atoi(argv[1]);
   }
   cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
   EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
   cl->setProfiling(true);
 //  testVectorSize(cl);
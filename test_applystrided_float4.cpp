@@ -0,0 +1,163 @@
+#include <iostream>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "kernelresources.h"
+
+// test_applystrided only ever issues scalar loads, even though most of our
+// non-contiguous tensors are row slices, ie the inner dimension is contiguous
+// and only the row stride is 'wrong', eg after narrow() on dimension 1:
+//
+// size: {R, SIZE1}
+// stride: {STRIDE0, 1}, with STRIDE0 > SIZE1
+//
+// so here we compare:
+// - scalar: one work item per element, x0 = linearId / SIZE1, x1 = linearId % SIZE1
+// - float4: one work item per 4 inner elements, using vload4/vstore4 from the
+//   start of the row.  vload4 only needs float alignment, so STRIDE0 doesnt
+//   need to be a multiple of 4.  when SIZE1 isnt a multiple of 4, the last
+//   work item in each row peels off the 1-3 remaining elements as scalars
+
+static const char *scalarSource = R"DELIM(
+  #define STRIDE0 {{stride0}}
+  #define SIZE1 {{size1}}
+  kernel void test(int totalN, global float*_out) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      int x1 = linearId % SIZE1;
+      int x0 = linearId / SIZE1;
+      int storageOffset = x0 * STRIDE0 + x1;
+      float out = _out[storageOffset];
+      _out[storageOffset] = out + 3.3f;
+    }
+  }
+)DELIM";
+
+static const char *float4Source = R"DELIM(
+  #define STRIDE0 {{stride0}}
+  #define SIZE1 {{size1}}
+  #define VEC_PER_ROW ((SIZE1 + 3) / 4)
+  kernel void test(int totalVecs, global float*_out) {
+    int vecId = get_global_id(0);
+    if(vecId < totalVecs) {
+      int xv = vecId % VEC_PER_ROW;
+      int x0 = vecId / VEC_PER_ROW;
+      global float *row = _out + x0 * STRIDE0;
+      int x1 = xv * 4;
+      if(x1 + 4 <= SIZE1) {
+        float4 out = vload4(0, row + x1);
+        vstore4(out + 3.3f, 0, row + x1);
+      } else {
+        for(int i = x1; i < SIZE1; i++) {
+          row[i] = row[i] + 3.3f;
+        }
+      }
+    }
+  }
+)DELIM";
+
+void test(EasyCL *cl, bool vectorized, int size1, int rowPadding) {
+  resetMemoryStats();
+  int targetN = 32 * 1024 * 1024;
+  int size0 = targetN / size1;
+  int stride0 = size1 + rowPadding;
+  int totalN = size0 * size1;
+  int storageN = size0 * stride0;
+
+  string templatedSource = vectorized ? float4Source : scalarSource;
+  templatedSource = easycl::replace(templatedSource, "{{stride0}}", easycl::toString(stride0));
+  templatedSource = easycl::replace(templatedSource, "{{size1}}", easycl::toString(size1));
+  CLKernel *kernel = cl->buildKernelFromString(templatedSource, "test", "");
+  const int workgroupSize = 64;
+  int numItems = totalN;
+  if(vectorized) {
+    numItems = size0 * ((size1 + 3) / 4);
+  }
+  int numWorkgroups = (numItems + workgroupSize - 1) / workgroupSize;
+
+  float *in = new float[storageN];
+  float *inOut = new float[storageN];
+  for( int i = 0; i < storageN; i++ ) {
+      in[i] = inOut[i] = (i + 4) % 1000000;
+  }
+  CLWrapper *wrapper = cl->wrap(storageN, inOut);
+  memoryCopyToDevice(wrapper);
+
+  cl->finish();
+  cl->dumpProfiling();
+
+  double start = StatefulTimer::instance()->getSystemMilliseconds();
+  kernel->in(numItems);
+  kernel->inout(wrapper);
+  kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+
+  cl->finish();
+  double end = StatefulTimer::instance()->getSystemMilliseconds();
+  cl->dumpProfiling();
+  memoryCopyToHost(wrapper);
+  cl->finish();
+  cout << "vectorized=" << vectorized << " size1=" << size1 << " stride0=" << stride0 << " totalN=" << totalN << " time=" << (end - start) << "ms"
+    << rooflineString(end - start, (double)totalN * 2 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, templatedSource, "test", workgroupSize) << endl;
+
+  int errorCount = 0;
+  for( int x0 = 0; x0 < size0; x0++ ) {
+    for( int x1 = 0; x1 < stride0; x1++ ) {
+      int i = x0 * stride0 + x1;
+      float targetValue = x1 < size1 ? in[i] + 3.3f : in[i];
+      if(inOut[i] != targetValue ) {
+        errorCount++;
+        if( errorCount < 20 ) {
+          cout << "x0=" << x0 << " x1=" << x1 << " " << targetValue << " != " << inOut[i] << endl;
+        }
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of storageN=" << storageN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(wrapper);
+  delete[] in;
+  delete[] inOut;
+  delete kernel;
+}
+
+void testRowSlice(EasyCL *cl) {
+  // row slice of a tensor twice as wide, eg narrow(2, 1, size1), so rows stay 16-byte aligned
+  int sizes[] = { 4, 32, 64, 128 };
+  for( int i = 0; i < 4; i++ ) {
+    test(cl, false, sizes[i], sizes[i]);
+    test(cl, true, sizes[i], sizes[i]);
+  }
+  // odd padding, so rows start at arbitrary float alignment
+  for( int i = 0; i < 4; i++ ) {
+    test(cl, false, sizes[i], 1);
+    test(cl, true, sizes[i], 1);
+  }
+  // inner size not divisible by 4, so last item in each row peels the remainder
+  test(cl, false, 30, 2);
+  test(cl, true, 30, 2);
+  test(cl, false, 65, 3);
+  test(cl, true, 65, 3);
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  cl->setProfiling(true);
+  testRowSlice(cl);
+  delete cl;
+  return 0;
+}
+
@@ -0,0 +1,470 @@
+#include <iostream>
+#include <cmath>
+#include <map>
+#include <vector>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+#include "chrometrace.h"
+
+// an lstm step, as a graph of launches and transfers, run two ways:
+// - finish: clFinish after every op, as the benchmarks, and the framework
+//   they model, tend to
+// - events: every op enqueued with an explicit wait list, and the host only
+//   blocks where it reads a result back, here h at the end of the sequence
+// each on an in-order queue, and an out-of-order queue, where the two gate
+// matmuls, and the four gate nonlinearities, are free to overlap
+//
+// EventExecutor works out the graph from the buffers each op reads and
+// writes: an op waits for the last write to anything it touches, and, for
+// anything it writes, for the reads since then.  so ops are enqueued as they
+// are added, and the dag is never built explicitly
+//
+// test_eventdag [gpu] [tracefile] also writes the first sequence of each
+// configuration as a chrome trace, via chrometrace.h: kernels and transfers
+// on the queue's track, and the blocking read and finishes on the host's.
+// tracing needs a profiling queue, so timings with a tracefile arent quite
+// comparable with those without
+//
+// per step, char-rnn style, batch B, hidden H, input size I:
+//   gx = x * Wx^T, gh = hprev * Wh^T          {B, 4H} each
+//   gates = gx + gh + bias
+//   i, f, o = sigmoid(gates slices 0, 1, 2), g = tanh(gates slice 3)
+//   c = f * cprev + i * g
+//   h = o * tanh(c)
+
+static const char *kernelSource = R"DELIM(
+  kernel void matmulT(int M, int N, int K, global const float *A, global const float *B, global float *C) {
+    int linearId = get_global_id(0);
+    if(linearId < M * N) {
+      int m = linearId / N;
+      int n = linearId % N;
+      float sum = 0;
+      for(int k = 0; k < K; k++) {
+        sum += A[m * K + k] * B[n * K + k];
+      }
+      C[linearId] = sum;
+    }
+  }
+
+  kernel void add3(int totalN, int N, global const float *a, global const float *b, global const float *bias, global float *out) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out[linearId] = a[linearId] + b[linearId] + bias[linearId % N];
+    }
+  }
+
+  kernel void gate(int totalN, int H, int slice, int isTanh, global const float *gates, global float *out) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      int b = linearId / H;
+      int j = linearId % H;
+      float value = gates[b * 4 * H + slice * H + j];
+      out[linearId] = isTanh ? tanh(value) : 1.0f / (1.0f + exp(-value));
+    }
+  }
+
+  kernel void cell(int totalN, global const float *f, global const float *cprev, global const float *i, global const float *g, global float *c) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      c[linearId] = f[linearId] * cprev[linearId] + i[linearId] * g[linearId];
+    }
+  }
+
+  kernel void tanhApply(int totalN, global const float *in, global float *out) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out[linearId] = tanh(in[linearId]);
+    }
+  }
+
+  kernel void mul(int totalN, global const float *a, global const float *b, global float *out) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out[linearId] = a[linearId] * b[linearId];
+    }
+  }
+)DELIM";
+
+class EventExecutor {
+public:
+  EventExecutor(cl_command_queue queue, bool finishEachOp) :
+      numOps(0),
+      numFinishes(0),
+      queue(queue),
+      finishEachOp(finishEachOp),
+      trace(0),
+      queueTrack(0),
+      hostTrack(0),
+      kernel(0),
+      argIndex(0) {
+  }
+  // trace = 0 stops tracing
+  void setTrace(ChromeTrace *trace, int queueTrack, int hostTrack) {
+    this->trace = trace;
+    this->queueTrack = queueTrack;
+    this->hostTrack = hostTrack;
+  }
+  EventExecutor *begin(cl_kernel kernel) {
+    this->kernel = kernel;
+    if(trace != 0) {
+      char name[256];
+      clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, 0);
+      opName = name;
+    }
+    argIndex = 0;
+    reads.clear();
+    writes.clear();
+    return this;
+  }
+  EventExecutor *in(int value) {
+    EasyCL::checkError(clSetKernelArg(kernel, argIndex++, sizeof(value), &value));
+    return this;
+  }
+  EventExecutor *in(cl_mem buffer) {
+    EasyCL::checkError(clSetKernelArg(kernel, argIndex++, sizeof(buffer), &buffer));
+    reads.push_back(buffer);
+    return this;
+  }
+  EventExecutor *out(cl_mem buffer) {
+    EasyCL::checkError(clSetKernelArg(kernel, argIndex++, sizeof(buffer), &buffer));
+    writes.push_back(buffer);
+    return this;
+  }
+  void run(int N, int workgroupSize = 64) {
+    size_t global = ((N + workgroupSize - 1) / workgroupSize) * workgroupSize;
+    size_t local = workgroupSize;
+    vector<cl_event> waits = dependencies();
+    cl_event event;
+    EasyCL::checkError(clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global, &local,
+      waits.size(), waits.size() > 0 ? &waits[0] : 0, &event));
+    completed(event, "kernel");
+  }
+  // non-blocking, so host must leave the source alone until the next finish()
+  void write(cl_mem buffer, size_t bytes, const void *host) {
+    reads.clear();
+    writes.clear();
+    writes.push_back(buffer);
+    opName = "write";
+    vector<cl_event> waits = dependencies();
+    cl_event event;
+    EasyCL::checkError(clEnqueueWriteBuffer(queue, buffer, CL_FALSE, 0, bytes, host,
+      waits.size(), waits.size() > 0 ? &waits[0] : 0, &event));
+    completed(event, "transfer");
+  }
+  // the one place the host blocks
+  void read(cl_mem buffer, size_t bytes, void *host) {
+    reads.clear();
+    writes.clear();
+    reads.push_back(buffer);
+    opName = "read";
+    vector<cl_event> waits = dependencies();
+    cl_event event;
+    long long start = ChromeTrace::now();
+    EasyCL::checkError(clEnqueueReadBuffer(queue, buffer, CL_TRUE, 0, bytes, host,
+      waits.size(), waits.size() > 0 ? &waits[0] : 0, &event));
+    if(trace != 0) {
+      trace->host(hostTrack, "read", start, ChromeTrace::now());
+    }
+    completed(event, "transfer");
+  }
+  void finish() {
+    long long start = ChromeTrace::now();
+    clFinish(queue);
+    if(trace != 0) {
+      trace->host(hostTrack, "finish", start, ChromeTrace::now());
+    }
+    for( int i = 0; i < (int)events.size(); i++ ) {
+      clReleaseEvent(events[i]);
+    }
+    events.clear();
+    lastWrite.clear();
+    readsSinceWrite.clear();
+  }
+
+  int numOps;
+  int numFinishes;
+
+protected:
+  vector<cl_event> dependencies() {
+    vector<cl_event> waits;
+    for( int i = 0; i < (int)reads.size(); i++ ) {
+      if(lastWrite.find(reads[i]) != lastWrite.end()) {
+        waits.push_back(lastWrite[reads[i]]);
+      }
+    }
+    for( int i = 0; i < (int)writes.size(); i++ ) {
+      if(lastWrite.find(writes[i]) != lastWrite.end()) {
+        waits.push_back(lastWrite[writes[i]]);
+      }
+      vector<cl_event> &readers = readsSinceWrite[writes[i]];
+      waits.insert(waits.end(), readers.begin(), readers.end());
+    }
+    return waits;
+  }
+  void completed(cl_event event, string category) {
+    if(trace != 0) {
+      trace->device(queueTrack, event, opName, category);
+    }
+    events.push_back(event);
+    for( int i = 0; i < (int)reads.size(); i++ ) {
+      readsSinceWrite[reads[i]].push_back(event);
+    }
+    for( int i = 0; i < (int)writes.size(); i++ ) {
+      lastWrite[writes[i]] = event;
+      readsSinceWrite[writes[i]].clear();
+    }
+    numOps++;
+    if(finishEachOp) {
+      long long start = ChromeTrace::now();
+      clFinish(queue);
+      if(trace != 0) {
+        trace->host(hostTrack, "finish", start, ChromeTrace::now());
+      }
+      numFinishes++;
+    }
+  }
+
+  cl_command_queue queue;
+  bool finishEachOp;
+  ChromeTrace *trace;
+  int queueTrack;
+  int hostTrack;
+  cl_kernel kernel;
+  string opName;
+  int argIndex;
+  vector<cl_mem> reads;
+  vector<cl_mem> writes;
+  vector<cl_event> events;
+  map<cl_mem, cl_event> lastWrite;
+  map<cl_mem, vector<cl_event> > readsSinceWrite;
+};
+
+float sigmoid(float x) {
+  return 1.0f / (1.0f + exp(-x));
+}
+
+// final h, computed on the host
+void lstmReference(int seqLength, int B, int H, int I, const float *x, const float *Wx, const float *Wh, const float *bias, float *h) {
+  vector<float> c(B * H, 0);
+  vector<float> gates(B * 4 * H);
+  for( int i = 0; i < B * H; i++ ) {
+    h[i] = 0;
+  }
+  for( int t = 0; t < seqLength; t++ ) {
+    const float *xt = x + t * B * I;
+    for( int b = 0; b < B; b++ ) {
+      for( int n = 0; n < 4 * H; n++ ) {
+        float gx = 0;
+        for( int k = 0; k < I; k++ ) {
+          gx += xt[b * I + k] * Wx[n * I + k];
+        }
+        float gh = 0;
+        for( int k = 0; k < H; k++ ) {
+          gh += h[b * H + k] * Wh[n * H + k];
+        }
+        gates[b * 4 * H + n] = gx + gh + bias[n];
+      }
+    }
+    for( int b = 0; b < B; b++ ) {
+      for( int j = 0; j < H; j++ ) {
+        float *g = &gates[b * 4 * H];
+        float ig = sigmoid(g[j]);
+        float fg = sigmoid(g[H + j]);
+        float og = sigmoid(g[2 * H + j]);
+        float gg = tanh(g[3 * H + j]);
+        c[b * H + j] = fg * c[b * H + j] + ig * gg;
+        h[b * H + j] = og * tanh(c[b * H + j]);
+      }
+    }
+  }
+}
+
+void test(EasyCL *cl, int seqLength, int B, int H, int I, bool outOfOrder, bool finishEachOp, ChromeTrace *trace) {
+  resetMemoryStats();
+  string queueName = outOfOrder ? "outoforder" : "inorder";
+  string mode = finishEachOp ? "finish" : "events";
+  cl_int err;
+  cl_command_queue_properties properties = outOfOrder ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0;
+  if(trace->isOpen()) {
+    properties |= CL_QUEUE_PROFILING_ENABLE;
+  }
+  cl_command_queue queue = clCreateCommandQueue(*cl->context, cl->device, properties, &err);
+  if(err != CL_SUCCESS) {
+    cout << "queue=" << queueName << " not supported, error " << err << ", skipping" << endl;
+    return;
+  }
+  const char *source = kernelSource;
+  cl_program program = clCreateProgramWithSource(*cl->context, 1, &source, 0, &err);
+  EasyCL::checkError(err);
+  EasyCL::checkError(clBuildProgram(program, 1, &cl->device, "", 0, 0));
+  map<string, cl_kernel> kernels;
+  const char *kernelNames[] = { "matmulT", "add3", "gate", "cell", "tanhApply", "mul" };
+  for( int k = 0; k < 6; k++ ) {
+    kernels[kernelNames[k]] = clCreateKernel(program, kernelNames[k], &err);
+    EasyCL::checkError(err);
+  }
+
+  float *x = new float[seqLength * B * I];
+  float *Wx = new float[4 * H * I];
+  float *Wh = new float[4 * H * H];
+  float *bias = new float[4 * H];
+  float *h = new float[B * H];
+  float *zeros = new float[B * H];
+  for( int i = 0; i < seqLength * B * I; i++ ) {
+    x[i] = ((i * 7) % 13 - 6) / 6.0f;
+  }
+  for( int i = 0; i < 4 * H * I; i++ ) {
+    Wx[i] = ((i * 5) % 11 - 5) / 50.0f;
+  }
+  for( int i = 0; i < 4 * H * H; i++ ) {
+    Wh[i] = ((i * 3) % 17 - 8) / 80.0f;
+  }
+  for( int i = 0; i < 4 * H; i++ ) {
+    bias[i] = (i % 5 - 2) / 10.0f;
+  }
+  for( int i = 0; i < B * H; i++ ) {
+    zeros[i] = 0;
+  }
+
+  // name, floats, so the memory line can count them
+  map<string, cl_mem> buffers;
+  map<string, size_t> sizes;
+  sizes["x"] = B * I;
+  sizes["Wx"] = 4 * H * I;
+  sizes["Wh"] = 4 * H * H;
+  sizes["bias"] = 4 * H;
+  sizes["gx"] = sizes["gh"] = sizes["gates"] = B * 4 * H;
+  sizes["i"] = sizes["f"] = sizes["o"] = sizes["g"] = sizes["tanhc"] = B * H;
+  sizes["h0"] = sizes["h1"] = sizes["c0"] = sizes["c1"] = B * H;
+  for( map<string, size_t>::iterator it = sizes.begin(); it != sizes.end(); it++ ) {
+    buffers[it->first] = clCreateBuffer(*cl->context, CL_MEM_READ_WRITE, it->second * sizeof(float), 0, &err);
+    EasyCL::checkError(err);
+    memoryRawAllocated(it->second * sizeof(float));
+  }
+
+  EventExecutor executor(queue, finishEachOp);
+  executor.write(buffers["Wx"], sizes["Wx"] * sizeof(float), Wx);
+  executor.write(buffers["Wh"], sizes["Wh"] * sizeof(float), Wh);
+  executor.write(buffers["bias"], sizes["bias"] * sizeof(float), bias);
+  executor.finish();
+  memoryRawCopied((sizes["Wx"] + sizes["Wh"] + sizes["bias"]) * sizeof(float), 0);
+
+  auto sequence = [&]() {
+    executor.write(buffers["h0"], B * H * sizeof(float), zeros);
+    executor.write(buffers["c0"], B * H * sizeof(float), zeros);
+    for( int t = 0; t < seqLength; t++ ) {
+      cl_mem hprev = buffers[t % 2 == 0 ? "h0" : "h1"];
+      cl_mem hnext = buffers[t % 2 == 0 ? "h1" : "h0"];
+      cl_mem cprev = buffers[t % 2 == 0 ? "c0" : "c1"];
+      cl_mem cnext = buffers[t % 2 == 0 ? "c1" : "c0"];
+      executor.write(buffers["x"], B * I * sizeof(float), x + t * B * I);
+      executor.begin(kernels["matmulT"])->in(B)->in(4 * H)->in(I)->in(buffers["x"])->in(buffers["Wx"])->out(buffers["gx"])->run(B * 4 * H);
+      executor.begin(kernels["matmulT"])->in(B)->in(4 * H)->in(H)->in(hprev)->in(buffers["Wh"])->out(buffers["gh"])->run(B * 4 * H);
+      executor.begin(kernels["add3"])->in(B * 4 * H)->in(4 * H)->in(buffers["gx"])->in(buffers["gh"])->in(buffers["bias"])->out(buffers["gates"])->run(B * 4 * H);
+      const char *gateNames[] = { "i", "f", "o", "g" };
+      for( int slice = 0; slice < 4; slice++ ) {
+        executor.begin(kernels["gate"])->in(B * H)->in(H)->in(slice)->in(slice == 3 ? 1 : 0)->in(buffers["gates"])->out(buffers[gateNames[slice]])->run(B * H);
+      }
+      executor.begin(kernels["cell"])->in(B * H)->in(buffers["f"])->in(cprev)->in(buffers["i"])->in(buffers["g"])->out(cnext)->run(B * H);
+      executor.begin(kernels["tanhApply"])->in(B * H)->in(cnext)->out(buffers["tanhc"])->run(B * H);
+      executor.begin(kernels["mul"])->in(B * H)->in(buffers["o"])->in(buffers["tanhc"])->out(hnext)->run(B * H);
+    }
+    executor.read(buffers[seqLength % 2 == 0 ? "h0" : "h1"], B * H * sizeof(float), h);
+    executor.finish();
+    memoryRawCopied((2.0 * B * H + (double)seqLength * B * I) * sizeof(float), (double)B * H * sizeof(float));
+  };
+
+  if(trace->isOpen()) {
+    string name = "H=" + easycl::toString(H) + " " + queueName + " " + mode;
+    executor.setTrace(trace, trace->addQueue(queue, "queue " + name), trace->addTrack("host " + name));
+  }
+  sequence();
+  executor.setTrace(0, 0, 0);
+  executor.numOps = 0;
+  executor.numFinishes = 0;
+  AdaptiveResult result = measureAdaptive([&]() {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    sequence();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  int numSequences = result.samples.size();
+  double flops = (double)seqLength * 2 * B * 4 * H * (I + H);
+  cout << "lstm seqlength=" << seqLength << " B=" << B << " H=" << H << " I=" << I
+    << " queue=" << queueName << " mode=" << mode
+    << " ops/seq=" << executor.numOps / numSequences << " finishes/seq=" << executor.numFinishes / numSequences
+    << adaptiveString(result) << " per step=" << result.median / seqLength << "ms"
+    << rooflineString(result.median, (double)seqLength * (4 * H * (I + H) + B * I) * sizeof(float), flops);
+  for( int k = 0; k < 6; k++ ) {
+    cout << kernelResourceString(cl, kernels[kernelNames[k]], 64);
+  }
+  cout << endl;
+
+  float *targetH = new float[B * H];
+  lstmReference(seqLength, B, H, I, x, Wx, Wh, bias, targetH);
+  int errorCount = 0;
+  for( int i = 0; i < B * H; i++ ) {
+    if(abs(h[i] - targetH[i]) > 0.001f) {
+      errorCount++;
+      if( errorCount < 20 ) {
+        cout << "h[" << i << "]=" << h[i] << " != " << targetH[i] << endl;
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of " << B * H << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  for( map<string, cl_mem>::iterator it = buffers.begin(); it != buffers.end(); it++ ) {
+    clReleaseMemObject(it->second);
+    memoryRawReleased(sizes[it->first] * sizeof(float));
+  }
+  for( int k = 0; k < 6; k++ ) {
+    clReleaseKernel(kernels[kernelNames[k]]);
+  }
+  clReleaseProgram(program);
+  executor.finish();
+  clReleaseCommandQueue(queue);
+  delete[] x;
+  delete[] Wx;
+  delete[] Wh;
+  delete[] bias;
+  delete[] h;
+  delete[] zeros;
+  delete[] targetH;
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc >= 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  ChromeTrace trace;
+  if( argc >= 3 ) {
+    trace.open(argv[2]);
+  }
+  // char-rnn: sequence of 50, batch 50, vocab of about 65 into the first layer
+  for( int H = 128; H <= 512; H *= 4 ) {
+    for( int outOfOrder = 0; outOfOrder < 2; outOfOrder++ ) {
+      test(cl, 50, 50, H, 65, outOfOrder == 1, true, &trace);
+      test(cl, 50, 50, H, 65, outOfOrder == 1, false, &trace);
+    }
+  }
+  if(trace.isOpen()) {
+    trace.close();
+    cout << "wrote " << argv[2] << endl;
+  }
+  delete cl;
+  return 0;
+}
+
@@ -0,0 +1,262 @@
+#include <iostream>
+#include <cmath>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "templates/TemplatedKernel.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// gemm, C = A * B, row-major, C is {M, N}, sized like char-rnn's linear layers,
+// so we can see how the matrix multiplies compare with the pointwise applies
+// that the other benchmarks measure
+//
+// A is {M, K}, or stored as {K, M} if transA, and B is {K, N}, or stored as
+// {N, K} if transB.  nn.Linear's forward is input * weight^T, so transB, and
+// the weight gradient is gradOutput^T * input, so transA
+//
+// modes:
+// - naive: one work item per element of C, reading A and B straight from
+//   global memory
+// - tiled: 16x16 workgroup computes a 16x16 tile of C, staging 16x16 tiles of
+//   A and B in __local
+// - regblock: 8x8 workgroup computes a 32x32 tile of C, each work item
+//   accumulating a 4x4 block in registers, so each value read from __local
+//   is used 4 times
+//
+// tiled and regblock are the same kernel, with tileSize and workPerThread
+// varied.  the tiles are always loaded with consecutive work items reading
+// consecutive addresses, whichever way round A and B are stored
+
+static const char *kernelSource = R"DELIM(
+  {% if transA == 1 then %}
+  #define A_AT(m, k) A[(k) * M + (m)]
+  {% else %}
+  #define A_AT(m, k) A[(m) * K + (k)]
+  {% end %}
+  {% if transB == 1 then %}
+  #define B_AT(k, n) B[(n) * K + (k)]
+  {% else %}
+  #define B_AT(k, n) B[(k) * N + (n)]
+  {% end %}
+
+  {% if mode == "naive" then %}
+  kernel void test(int M, int N, int K, global const float *A, global const float *B, global float *C) {
+    int linearId = get_global_id(0);
+    if(linearId < M * N) {
+      int row = linearId / N;
+      int col = linearId % N;
+      float sum = 0;
+      for(int k = 0; k < K; k++) {
+        sum += A_AT(row, k) * B_AT(k, col);
+      }
+      C[linearId] = sum;
+    }
+  }
+  {% else %}
+  #define TS {{tileSize}}
+  #define WPT {{workPerThread}}
+  #define RTS (TS / WPT)
+
+  kernel void test(int M, int N, int K, global const float *A, global const float *B, global float *C) {
+    local float Asub[TS][TS];
+    local float Bsub[TS][TS];
+
+    int numTilesN = (N + TS - 1) / TS;
+    int row0 = get_group_id(0) / numTilesN * TS;
+    int col0 = get_group_id(0) % numTilesN * TS;
+    int localId = get_local_id(0);
+    int ty = localId / RTS;
+    int tx = localId % RTS;
+
+    float acc[WPT][WPT];
+    for(int i = 0; i < WPT; i++) {
+      for(int j = 0; j < WPT; j++) {
+        acc[i][j] = 0;
+      }
+    }
+
+    for(int k0 = 0; k0 < K; k0 += TS) {
+      for(int l = 0; l < WPT * WPT; l++) {
+        int idx = l * RTS * RTS + localId;
+        int r = idx / TS;
+        int c = idx % TS;
+        {% if transA == 1 then %}
+        Asub[c][r] = (row0 + c < M && k0 + r < K) ? A_AT(row0 + c, k0 + r) : 0;
+        {% else %}
+        Asub[r][c] = (row0 + r < M && k0 + c < K) ? A_AT(row0 + r, k0 + c) : 0;
+        {% end %}
+        {% if transB == 1 then %}
+        Bsub[c][r] = (k0 + c < K && col0 + r < N) ? B_AT(k0 + c, col0 + r) : 0;
+        {% else %}
+        Bsub[r][c] = (k0 + r < K && col0 + c < N) ? B_AT(k0 + r, col0 + c) : 0;
+        {% end %}
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      for(int k = 0; k < TS; k++) {
+        float bReg[WPT];
+        for(int j = 0; j < WPT; j++) {
+          bReg[j] = Bsub[k][tx + j * RTS];
+        }
+        for(int i = 0; i < WPT; i++) {
+          float a = Asub[ty + i * RTS][k];
+          for(int j = 0; j < WPT; j++) {
+            acc[i][j] += a * bReg[j];
+          }
+        }
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    for(int i = 0; i < WPT; i++) {
+      int row = row0 + ty + i * RTS;
+      for(int j = 0; j < WPT; j++) {
+        int col = col0 + tx + j * RTS;
+        if(row < M && col < N) {
+          C[row * N + col] = acc[i][j];
+        }
+      }
+    }
+  }
+  {% end %}
+)DELIM";
+
+void test(EasyCL *cl, string layer, int M, int N, int K, bool transA, bool transB, string mode) {
+  resetMemoryStats();
+  int tileSize = 16;
+  int workPerThread = 1;
+  if(mode == "regblock") {
+    tileSize = 32;
+    workPerThread = 4;
+  }
+
+  TemplatedKernel kernelBuilder(cl);
+  kernelBuilder.set("mode", mode);
+  kernelBuilder.set("transA", transA ? 1 : 0);
+  kernelBuilder.set("transB", transB ? 1 : 0);
+  kernelBuilder.set("tileSize", tileSize);
+  kernelBuilder.set("workPerThread", workPerThread);
+//  cout << kernelBuilder.getRenderedKernel(kernelSource) << endl;
+  string uniqueName = "gemm_" + mode + "_" + easycl::toString(transA ? 1 : 0) + easycl::toString(transB ? 1 : 0);
+  CLKernel *kernel = kernelBuilder.buildKernel(uniqueName, "gemm", kernelSource, "test");
+
+  int workgroupSize = 64;
+  int numWorkgroups = (M * N + workgroupSize - 1) / workgroupSize;
+  if(mode != "naive") {
+    int rts = tileSize / workPerThread;
+    workgroupSize = rts * rts;
+    numWorkgroups = ((M + tileSize - 1) / tileSize) * ((N + tileSize - 1) / tileSize);
+  }
+
+  float *a = new float[M * K];
+  float *b = new float[K * N];
+  float *c = new float[M * N];
+  for( int i = 0; i < M * K; i++ ) {
+    a[i] = ((i * 7) % 13 - 6) / 6.0f;
+  }
+  for( int i = 0; i < K * N; i++ ) {
+    b[i] = ((i * 5) % 11 - 5) / 5.0f;
+  }
+  CLWrapper *awrap = cl->wrap(M * K, a);
+  CLWrapper *bwrap = cl->wrap(K * N, b);
+  CLWrapper *cwrap = cl->wrap(M * N, c);
+  memoryCopyToDevice(awrap);
+  memoryCopyToDevice(bwrap);
+  memoryCreateOnDevice(cwrap);
+
+  cl->finish();
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for(int it = 0; it < batchSize; it++) {
+      kernel->in(M);
+      kernel->in(N);
+      kernel->in(K);
+      kernel->in(awrap);
+      kernel->in(bwrap);
+      kernel->out(cwrap);
+      kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    }
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  double flops = 2.0 * M * N * K;
+  // bytes if each operand only went through global memory once
+  double bytes = ((double)M * K + (double)K * N + (double)M * N) * sizeof(float);
+  cout << "gemm layer=" << layer << " M=" << M << " N=" << N << " K=" << K
+    << " transA=" << transA << " transB=" << transB << " mode=" << mode
+    << adaptiveString(result)
+    << rooflineString(result.median, bytes, flops)
+    << kernelResourceString(cl, kernelBuilder.getRenderedKernel(kernelSource), "test", workgroupSize) << endl;
+
+  memoryCopyToHost(cwrap);
+  int errorCount = 0;
+  for( int row = 0; row < M; row++ ) {
+    for( int col = 0; col < N; col++ ) {
+      double targetValue = 0;
+      for( int k = 0; k < K; k++ ) {
+        float aValue = transA ? a[k * M + row] : a[row * K + k];
+        float bValue = transB ? b[col * K + k] : b[k * N + col];
+        targetValue += (double)aValue * bValue;
+      }
+      float value = c[row * N + col];
+      if(abs(value - targetValue) > 1e-4 * K) {
+        errorCount++;
+        if( errorCount < 20 ) {
+          cout << "C[" << row << "][" << col << "]=" << value << " != " << targetValue << endl;
+        }
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of " << M * N << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(awrap);
+  memoryDelete(bwrap);
+  memoryDelete(cwrap);
+  delete[] a;
+  delete[] b;
+  delete[] c;
+}
+
+void testModes(EasyCL *cl, string layer, int M, int N, int K, bool transA, bool transB) {
+  test(cl, layer, M, N, K, transA, transB, "naive");
+  test(cl, layer, M, N, K, transA, transB, "tiled");
+  test(cl, layer, M, N, K, transA, transB, "regblock");
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  // char-rnn: batch 50, rnn_size 128 to 512, gates are 4 * rnn_size wide,
+  // and a vocab of about 65 for the decoder
+  const int batchSize = 50;
+  const int vocabSize = 65;
+  for( int hidden = 128; hidden <= 512; hidden *= 2 ) {
+    int gates = 4 * hidden;
+    // gates forward, input * weight^T, with the other three layouts for comparison
+    for( int t = 0; t < 4; t++ ) {
+      bool transA = (t & 2) != 0;
+      bool transB = (t & 1) == 0;
+      testModes(cl, "gates", batchSize, gates, hidden, transA, transB);
+    }
+    // gates backward: gradInput = gradOutput * weight, gradWeight = gradOutput^T * input
+    testModes(cl, "gradinput", batchSize, hidden, gates, false, false);
+    testModes(cl, "gradweight", gates, hidden, batchSize, true, false);
+    testModes(cl, "decoder", batchSize, vocabSize, hidden, false, true);
+  }
+  delete cl;
+  return 0;
+}
+
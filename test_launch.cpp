@@ -2,6 +2,10 @@
 using namespace std;
 #include "EasyCL.h"
 #include "util/StatefulTimer.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
 
 static const char *kernelSource = R"DELIM(
   kernel void test(int offset, int totalN, global float*out) {
@@ -13,6 +17,7 @@ static const char *kernelSource = R"DELIM(
 )DELIM";
 
 void test(EasyCL *cl, int totalN, int numLaunches) {
+  resetMemoryStats();
 //  int numLaunches = 1;
   int N = totalN / numLaunches;
 //  cout << kernelSource << endl;
@@ -25,12 +30,12 @@ void test(EasyCL *cl, int totalN, int numLaunches) {
       in[i] = i + 4;
   }
   CLWrapper *wrapper = cl->wrap(totalN, in);
-  wrapper->copyToDevice();
+  memoryCopyToDevice(wrapper);
 
   cl->finish();
   cl->dumpProfiling();
 
-  for(int it = 0; it < 1; it++ ) {
+  AdaptiveResult result = measureAdaptive([&]() {
     double start = StatefulTimer::instance()->getSystemMilliseconds();
     for( int i = 0; i < numLaunches; i++ ) {
       kernel->in(N * i);
@@ -39,15 +44,19 @@ void test(EasyCL *cl, int totalN, int numLaunches) {
       kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
     }
     cl->finish();
-    cl->dumpProfiling();
-    wrapper->copyToHost();
-  //  cout << "in[10]" << in[10] << endl;
-    double end = StatefulTimer::instance()->getSystemMilliseconds();
-  //  cout << "Time, " << numLaunches << " launches: " << (end - start) << "ms" << endl;
-    cout << "it=" << it << " totalN " << totalN << " launches " << numLaunches << " N per launch " << N << " time=" << (end - start) << "ms" << endl;
-  }
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  memoryCopyToHost(wrapper);
+//  cout << "in[10]" << in[10] << endl;
+  cl->dumpProfiling();
+//  cout << "Time, " << numLaunches << " launches: " << (end - start) << "ms" << endl;
+  cout << "totalN " << totalN << " launches " << numLaunches << " N per launch " << N << adaptiveString(result)
+    << rooflineString(result.median, (double)totalN * 2 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, kernelSource, "test", workgroupSize) << endl;
+
+  cout << "memory" << memoryString() << endl;
 
-  delete wrapper;
+  memoryDelete(wrapper);
   delete[] in;
   delete kernel;
 }
@@ -58,6 +67,7 @@ int main(int argc, char *argv[]) {
     gpu = atoi(argv[1]);
   }
   cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
   EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
   cl->setProfiling(true);
   for( int p = 0; p <= 14; p += 2 ) {
@@ -0,0 +1,216 @@
+#include <iostream>
+#include <vector>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "kernelresources.h"
+
+// replays the test_launch sweep, but routes the launches through a deferred
+// launch layer, which holds them until the next sync point, and merges
+// consecutive launches of the same kernel whose arguments are identical
+// except for a contiguous offset/count range
+//
+// the kernel takes an explicit count, rather than relying only on totalN,
+// so that each launch covers exactly [offset, offset + N), and merging two
+// launches is just summing their counts
+
+static const char *kernelSource = R"DELIM(
+  kernel void test(int offset, int N, int totalN, global float*out) {
+    int localId = get_global_id(0);
+    int linearId = localId + offset;
+    if(localId < N && linearId < totalN) {
+      out[linearId] = out[linearId] + 1.0f;
+    }
+  }
+)DELIM";
+
+class DeferredLauncher {
+public:
+  enum ArgType { INT, FLOAT, WRAPPER_IN, WRAPPER_OUT, WRAPPER_INOUT };
+  typedef struct Arg {
+    ArgType type;
+    int intValue;
+    float floatValue;
+    CLWrapper *wrapper;
+  } Arg;
+  typedef struct Launch {
+    CLKernel *kernel;
+    vector<Arg> args;
+  } Launch;
+
+  // offsetArg and countArg are the indices of the int args holding the start
+  // and length of the range each launch covers
+  DeferredLauncher(int offsetArg, int countArg, int workgroupSize, bool coalesce) :
+    numRequested(0), numSubmitted(0),
+    offsetArg(offsetArg), countArg(countArg), workgroupSize(workgroupSize), coalesce(coalesce) {
+  }
+  DeferredLauncher *begin(CLKernel *kernel) {
+    current.kernel = kernel;
+    current.args.clear();
+    return this;
+  }
+  DeferredLauncher *in(int value) {
+    Arg arg = { INT, value, 0.0f, 0 };
+    current.args.push_back(arg);
+    return this;
+  }
+  DeferredLauncher *in(float value) {
+    Arg arg = { FLOAT, 0, value, 0 };
+    current.args.push_back(arg);
+    return this;
+  }
+  DeferredLauncher *in(CLWrapper *wrapper) {
+    Arg arg = { WRAPPER_IN, 0, 0.0f, wrapper };
+    current.args.push_back(arg);
+    return this;
+  }
+  DeferredLauncher *out(CLWrapper *wrapper) {
+    Arg arg = { WRAPPER_OUT, 0, 0.0f, wrapper };
+    current.args.push_back(arg);
+    return this;
+  }
+  DeferredLauncher *inout(CLWrapper *wrapper) {
+    Arg arg = { WRAPPER_INOUT, 0, 0.0f, wrapper };
+    current.args.push_back(arg);
+    return this;
+  }
+  void launch() {
+    numRequested++;
+    if(coalesce && pending.size() > 0 && canMerge(pending.back(), current)) {
+      pending.back().args[countArg].intValue += current.args[countArg].intValue;
+      return;
+    }
+    pending.push_back(current);
+  }
+  void flush() {
+    for( int i = 0; i < (int)pending.size(); i++ ) {
+      submit(pending[i]);
+    }
+    pending.clear();
+  }
+  // sync point: anything deferred gets submitted now
+  void finish(EasyCL *cl) {
+    flush();
+    cl->finish();
+  }
+
+  int numRequested;
+  int numSubmitted;
+
+protected:
+  bool canMerge(const Launch &prev, const Launch &next) {
+    if(prev.kernel != next.kernel || prev.args.size() != next.args.size()) {
+      return false;
+    }
+    for( int i = 0; i < (int)prev.args.size(); i++ ) {
+      if(i == offsetArg || i == countArg) {
+        continue;
+      }
+      const Arg &a = prev.args[i];
+      const Arg &b = next.args[i];
+      if(a.type != b.type || a.intValue != b.intValue || a.floatValue != b.floatValue || a.wrapper != b.wrapper) {
+        return false;
+      }
+    }
+    return prev.args[offsetArg].intValue + prev.args[countArg].intValue == next.args[offsetArg].intValue;
+  }
+  void submit(const Launch &launch) {
+    CLKernel *kernel = launch.kernel;
+    for( int i = 0; i < (int)launch.args.size(); i++ ) {
+      const Arg &arg = launch.args[i];
+      switch(arg.type) {
+        case INT: kernel->in(arg.intValue); break;
+        case FLOAT: kernel->in(arg.floatValue); break;
+        case WRAPPER_IN: kernel->in(arg.wrapper); break;
+        case WRAPPER_OUT: kernel->out(arg.wrapper); break;
+        case WRAPPER_INOUT: kernel->inout(arg.wrapper); break;
+      }
+    }
+    int N = launch.args[countArg].intValue;
+    int numWorkgroups = (N + workgroupSize - 1) / workgroupSize;
+    kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    numSubmitted++;
+  }
+
+  int offsetArg;
+  int countArg;
+  int workgroupSize;
+  bool coalesce;
+  Launch current;
+  vector<Launch> pending;
+};
+
+void test(EasyCL *cl, int totalN, int numLaunches, bool coalesce) {
+  resetMemoryStats();
+  int N = totalN / numLaunches;
+  CLKernel *kernel = cl->buildKernelFromString(kernelSource, "test", "");
+  const int workgroupSize = 64;
+
+  float *in = new float[totalN];
+  for( int i = 0; i < totalN; i++ ) {
+      in[i] = (i + 4) % 1000000;
+  }
+  CLWrapper *wrapper = cl->wrap(totalN, in);
+  memoryCopyToDevice(wrapper);
+
+  cl->finish();
+  cl->dumpProfiling();
+
+  DeferredLauncher launcher(0, 1, workgroupSize, coalesce);
+  double start = StatefulTimer::instance()->getSystemMilliseconds();
+  for( int i = 0; i < numLaunches; i++ ) {
+    launcher.begin(kernel)
+      ->in(N * i)
+      ->in(N)
+      ->in(totalN)
+      ->inout(wrapper);
+    launcher.launch();
+  }
+  launcher.finish(cl);
+  double end = StatefulTimer::instance()->getSystemMilliseconds();
+  cl->dumpProfiling();
+  memoryCopyToHost(wrapper);
+  cout << "totalN " << totalN << " launches " << numLaunches << " N per launch " << N << " coalesce=" << coalesce
+    << " submitted=" << launcher.numSubmitted << " time=" << (end - start) << "ms"
+    << rooflineString(end - start, (double)totalN * 2 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, kernelSource, "test", workgroupSize) << endl;
+
+  int errorCount = 0;
+  for( int i = 0; i < totalN; i++ ) {
+    if(in[i] != (i + 4) % 1000000 + 1.0f) {
+      errorCount++;
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(wrapper);
+  delete[] in;
+  delete kernel;
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  cl->setProfiling(true);
+  for( int p = 0; p <= 14; p += 2 ) {
+    for(int totalN = 32 * 1024 * 1024; totalN <= 256 * 1024 * 1024; totalN *= 2 ) {
+      int numLaunches = 1 << p;
+      test(cl, totalN, numLaunches, false);
+      test(cl, totalN, numLaunches, true);
+    }
+  }
+  delete cl;
+  return 0;
+}
+
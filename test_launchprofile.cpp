@@ -0,0 +1,266 @@
+#include <iostream>
+#include <cmath>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "launchprofile.h"
+#include "chrometrace.h"
+#include "kernelresources.h"
+
+// where the host time goes in the 6400-element apply3 loop from
+// test_apply3, which is almost all launch path.  two kernels, mul and add,
+// alternate, as the pointwise ops in an lstm step would
+//
+// paths:
+// - easycl: phases are marshal, ie the kernel->in() calls, and run_1d
+// - easyclflush: as easycl, plus a clFlush after each launch, so the driver's
+//   submission shows up as its own phase, rather than being folded into
+//   whichever later call happens to trigger it
+// - raw: the same launches through the OpenCL api, on a profiling queue:
+//   setarg, enqueue and flush on the host, then from the event timestamps,
+//   queued->submit (driver submission), submit->start (waiting on the device)
+//   and start->end (the kernel itself).  easycl minus raw is what the wrapper
+//   costs
+//
+// test_launchprofile [gpu] [tracefile] also writes the reported pass of each
+// path as a chrome trace, via chrometrace.h: the host phases of every launch,
+// and the final finish, on a track per path, and for raw, the kernels, on the
+// queue's track
+
+static const char *kernelSource = R"DELIM(
+  kernel void mul(int totalN, global float*out, global float *in1, global float *in2) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out[linearId] = in1[linearId] * in2[linearId];
+    }
+  }
+
+  kernel void add(int totalN, global float*out, global float *in1, global float *in2) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out[linearId] = in1[linearId] + in2[linearId];
+    }
+  }
+)DELIM";
+
+void setArg(cl_kernel kernel, int argIndex, int value) {
+  EasyCL::checkError(clSetKernelArg(kernel, argIndex, sizeof(value), &value));
+}
+
+void setArg(cl_kernel kernel, int argIndex, CLWrapper *wrapper) {
+  cl_mem buffer = wrapper->getBuffer();
+  EasyCL::checkError(clSetKernelArg(kernel, argIndex, sizeof(buffer), &buffer));
+}
+
+cl_ulong eventTime(cl_event event, cl_profiling_info info) {
+  cl_ulong time = 0;
+  EasyCL::checkError(clGetEventProfilingInfo(event, info, sizeof(time), &time, 0));
+  return time;
+}
+
+void test(EasyCL *cl, int its, int size, string path, ChromeTrace *trace) {
+  resetMemoryStats();
+  int totalN = size;
+  const int workgroupSize = 64;
+  int numWorkgroups = (totalN + workgroupSize - 1) / workgroupSize;
+  const char *kernelNames[] = { "mul", "add" };
+
+  CLKernel *kernels[2];
+  cl_program program = 0;
+  cl_kernel rawKernels[2];
+  cl_command_queue queue = 0;
+  cl_int err;
+  if(path == "raw") {
+    const char *source = kernelSource;
+    program = clCreateProgramWithSource(*cl->context, 1, &source, 0, &err);
+    EasyCL::checkError(err);
+    EasyCL::checkError(clBuildProgram(program, 1, &cl->device, "", 0, 0));
+    for( int k = 0; k < 2; k++ ) {
+      rawKernels[k] = clCreateKernel(program, kernelNames[k], &err);
+      EasyCL::checkError(err);
+    }
+    queue = clCreateCommandQueue(*cl->context, cl->device, CL_QUEUE_PROFILING_ENABLE, &err);
+    EasyCL::checkError(err);
+  } else {
+    for( int k = 0; k < 2; k++ ) {
+      kernels[k] = cl->buildKernelFromString(kernelSource, kernelNames[k], "");
+    }
+  }
+
+  float *out[2];
+  float *in1 = new float[totalN];
+  float *in2 = new float[totalN];
+  for( int i = 0; i < totalN; i++ ) {
+      in1[i] = (i + 4) % 1000000;
+      in2[i] = (i + 6) % 1000000;
+  }
+  CLWrapper *outwrap[2];
+  for( int k = 0; k < 2; k++ ) {
+    out[k] = new float[totalN];
+    outwrap[k] = cl->wrap(totalN, out[k]);
+    memoryCreateOnDevice(outwrap[k]);
+  }
+  CLWrapper *in1wrap = cl->wrap(totalN, in1);
+  CLWrapper *in2wrap = cl->wrap(totalN, in2);
+  memoryCopyToDevice(in1wrap);
+  memoryCopyToDevice(in2wrap);
+  cl->finish();
+
+  int hostTrack = 0;
+  int queueTrack = 0;
+  if(trace->isOpen()) {
+    hostTrack = trace->addTrack("host " + path);
+    if(path == "raw") {
+      queueTrack = trace->addQueue(queue, "queue raw");
+    }
+  }
+
+  LaunchProfile profile;
+  vector<cl_event> events;
+  // first pass warms up, second is the one reported
+  double start = 0;
+  for( int pass = 0; pass < 2; pass++ ) {
+    profile.clear();
+    start = StatefulTimer::instance()->getSystemMilliseconds();
+    bool tracing = pass == 1 && trace->isOpen();
+    for( int it = 0; it < its; it++ ) {
+      int k = it % 2;
+      string name = kernelNames[k];
+      long long launchStart = ChromeTrace::now();
+      if(path == "raw") {
+        profile.start();
+        setArg(rawKernels[k], 0, totalN);
+        setArg(rawKernels[k], 1, outwrap[k]);
+        setArg(rawKernels[k], 2, in1wrap);
+        setArg(rawKernels[k], 3, in2wrap);
+        profile.stamp(name, "setarg");
+        size_t global = numWorkgroups * workgroupSize;
+        size_t local = workgroupSize;
+        cl_event event;
+        EasyCL::checkError(clEnqueueNDRangeKernel(queue, rawKernels[k], 1, 0, &global, &local, 0, 0, &event));
+        profile.stamp(name, "enqueue");
+        clFlush(queue);
+        profile.stamp(name, "flush");
+        events.push_back(event);
+        if(tracing) {
+          trace->device(queueTrack, event, name, "kernel");
+        }
+      } else {
+        profile.start();
+        kernels[k]->in(totalN);
+        kernels[k]->out(outwrap[k]);
+        kernels[k]->in(in1wrap);
+        kernels[k]->in(in2wrap);
+        profile.stamp(name, "marshal");
+        kernels[k]->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+        profile.stamp(name, "run_1d");
+        if(path == "easyclflush") {
+          clFlush(*cl->queue);
+          profile.stamp(name, "flush");
+        }
+      }
+      if(tracing) {
+        trace->host(hostTrack, name, launchStart, ChromeTrace::now());
+      }
+    }
+    long long finishStart = ChromeTrace::now();
+    if(path == "raw") {
+      clFinish(queue);
+    } else {
+      cl->finish();
+    }
+    if(tracing) {
+      trace->host(hostTrack, "finish", finishStart, ChromeTrace::now());
+    }
+    if(pass == 0) {
+      for( int i = 0; i < (int)events.size(); i++ ) {
+        clReleaseEvent(events[i]);
+      }
+      events.clear();
+    }
+  }
+  double end = StatefulTimer::instance()->getSystemMilliseconds();
+  for( int i = 0; i < (int)events.size(); i++ ) {
+    string name = kernelNames[i % 2];
+    cl_ulong queued = eventTime(events[i], CL_PROFILING_COMMAND_QUEUED);
+    cl_ulong submitted = eventTime(events[i], CL_PROFILING_COMMAND_SUBMIT);
+    cl_ulong started = eventTime(events[i], CL_PROFILING_COMMAND_START);
+    cl_ulong ended = eventTime(events[i], CL_PROFILING_COMMAND_END);
+    profile.add(name, "queued->submit", submitted - queued);
+    profile.add(name, "submit->start", started - submitted);
+    profile.add(name, "start->end", ended - started);
+    clReleaseEvent(events[i]);
+  }
+  cout << "its=" << its << " size=" << size << " path=" << path << " time=" << (end - start) << "ms"
+    << " per launch=" << (end - start) / its << "ms"
+    << rooflineString(end - start, (double)its * totalN * 3 * sizeof(float), (double)its * totalN)
+    << kernelResourceString(cl, kernelSource, "mul", workgroupSize)
+    << kernelResourceString(cl, kernelSource, "add", workgroupSize) << endl;
+  cout << profile.report(" path=" + path);
+
+  int errorCount = 0;
+  for( int k = 0; k < 2; k++ ) {
+    memoryCopyToHost(outwrap[k]);
+    for( int i = 0; i < totalN; i++ ) {
+      float targetValue = k == 0 ? in1[i] * in2[i] : in1[i] + in2[i];
+      if(abs(out[k][i] - targetValue) > 0.1f) {
+        errorCount++;
+        if( errorCount < 20 ) {
+          cout << kernelNames[k] << " out[" << i << "]=" << out[k][i] << " != " << targetValue << endl;
+        }
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  if(path == "raw") {
+    for( int k = 0; k < 2; k++ ) {
+      clReleaseKernel(rawKernels[k]);
+    }
+    clReleaseProgram(program);
+    clReleaseCommandQueue(queue);
+  } else {
+    for( int k = 0; k < 2; k++ ) {
+      delete kernels[k];
+    }
+  }
+  for( int k = 0; k < 2; k++ ) {
+    memoryDelete(outwrap[k]);
+    delete[] out[k];
+  }
+  memoryDelete(in1wrap);
+  memoryDelete(in2wrap);
+  delete[] in1;
+  delete[] in2;
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc >= 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  ChromeTrace trace;
+  if( argc >= 3 ) {
+    trace.open(argv[2]);
+  }
+  test(cl, 900, 6400, "easycl", &trace);
+  test(cl, 900, 6400, "easyclflush", &trace);
+  test(cl, 900, 6400, "raw", &trace);
+  if(trace.isOpen()) {
+    trace.close();
+    cout << "wrote " << argv[2] << endl;
+  }
+  delete cl;
+  return 0;
+}
+
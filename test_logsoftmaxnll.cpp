@@ -0,0 +1,333 @@
+#include <iostream>
+#include <cmath>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "templates/TemplatedKernel.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// char-rnn's output layer: log-softmax over the vocab, for each row of the
+// batch, then ClassNLL, ie mean over rows of -logprobs[row][target[row]]
+//
+// modes:
+// - unfused: the way it comes out of separate tensor ops:
+//     rowmax (reduce), exp(in - max) (apply), rowsum (reduce),
+//     log(out / sum) (apply), gather at target (apply), reduceAll
+//   reduceAll hands the loss back to the host, like cltorch's, so thats one
+//   sync per step, as well as six passes
+// - fused: one workgroup per row, max and sum reduced in __local, writing
+//   logprobs and the row loss in one pass over the row, then a one-workgroup
+//   kernel averages the row losses into a loss that stays on the device
+//
+// the reductions in unfused also use a workgroup per row, so the difference is
+// down to the extra passes, launches and syncs, rather than the reduction
+// strategy.  targets are floats, as they are for ClassNLLCriterion
+
+static const char *kernelSource = R"DELIM(
+  #define WORKGROUP_SIZE {{workgroupSize}}
+
+  float reduceMax(local float *scratch, float value) {
+    int localId = get_local_id(0);
+    scratch[localId] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for(int s = WORKGROUP_SIZE / 2; s > 0; s >>= 1) {
+      if(localId < s) {
+        scratch[localId] = max(scratch[localId], scratch[localId + s]);
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    float result = scratch[0];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return result;
+  }
+
+  float reduceSum(local float *scratch, float value) {
+    int localId = get_local_id(0);
+    scratch[localId] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for(int s = WORKGROUP_SIZE / 2; s > 0; s >>= 1) {
+      if(localId < s) {
+        scratch[localId] += scratch[localId + s];
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    float result = scratch[0];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return result;
+  }
+
+  kernel void rowmax(int V, global const float *in, global float *rowMax) {
+    local float scratch[WORKGROUP_SIZE];
+    global const float *rowIn = in + get_group_id(0) * V;
+    float value = -INFINITY;
+    for(int i = get_local_id(0); i < V; i += WORKGROUP_SIZE) {
+      value = max(value, rowIn[i]);
+    }
+    value = reduceMax(scratch, value);
+    if(get_local_id(0) == 0) {
+      rowMax[get_group_id(0)] = value;
+    }
+  }
+
+  kernel void rowsum(int V, global const float *in, global float *rowSum) {
+    local float scratch[WORKGROUP_SIZE];
+    global const float *rowIn = in + get_group_id(0) * V;
+    float value = 0;
+    for(int i = get_local_id(0); i < V; i += WORKGROUP_SIZE) {
+      value += rowIn[i];
+    }
+    value = reduceSum(scratch, value);
+    if(get_local_id(0) == 0) {
+      rowSum[get_group_id(0)] = value;
+    }
+  }
+
+  kernel void expsub(int totalN, int V, global const float *in, global const float *rowMax, global float *out) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out[linearId] = {{exp}}(in[linearId] - rowMax[linearId / V]);
+    }
+  }
+
+  kernel void logdiv(int totalN, int V, global const float *rowSum, global float *out) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out[linearId] = log(out[linearId] / rowSum[linearId / V]);
+    }
+  }
+
+  kernel void nll(int B, int V, global const float *logprobs, global const float *target, global float *rowLoss) {
+    int row = get_global_id(0);
+    if(row < B) {
+      rowLoss[row] = - logprobs[row * V + (int)target[row]];
+    }
+  }
+
+  // single workgroup
+  kernel void mean(int N, global const float *in, global float *out) {
+    local float scratch[WORKGROUP_SIZE];
+    float value = 0;
+    for(int i = get_local_id(0); i < N; i += WORKGROUP_SIZE) {
+      value += in[i];
+    }
+    value = reduceSum(scratch, value);
+    if(get_local_id(0) == 0) {
+      out[0] = value / N;
+    }
+  }
+
+  kernel void fused(int V, global const float *in, global const float *target, global float *logprobs, global float *rowLoss) {
+    local float scratch[WORKGROUP_SIZE];
+    int row = get_group_id(0);
+    global const float *rowIn = in + row * V;
+    global float *rowOut = logprobs + row * V;
+
+    float rowMax = -INFINITY;
+    for(int i = get_local_id(0); i < V; i += WORKGROUP_SIZE) {
+      rowMax = max(rowMax, rowIn[i]);
+    }
+    rowMax = reduceMax(scratch, rowMax);
+
+    float sum = 0;
+    for(int i = get_local_id(0); i < V; i += WORKGROUP_SIZE) {
+      sum += {{exp}}(rowIn[i] - rowMax);
+    }
+    float logSum = log(reduceSum(scratch, sum)) + rowMax;
+
+    for(int i = get_local_id(0); i < V; i += WORKGROUP_SIZE) {
+      rowOut[i] = rowIn[i] - logSum;
+    }
+    if(get_local_id(0) == 0) {
+      rowLoss[row] = logSum - rowIn[(int)target[row]];
+    }
+  }
+)DELIM";
+
+void test(EasyCL *cl, int B, int V, string mode, string expFunction, int workgroupSize) {
+  resetMemoryStats();
+  int totalN = B * V;
+
+  TemplatedKernel kernelBuilder(cl);
+  kernelBuilder.set("workgroupSize", workgroupSize);
+  kernelBuilder.set("exp", expFunction);
+//  cout << kernelBuilder.getRenderedKernel(kernelSource) << endl;
+  string uniqueName = "logsoftmaxnll_" + expFunction + "_" + easycl::toString(workgroupSize) + "_";
+  CLKernel *rowmaxKernel = kernelBuilder.buildKernel(uniqueName + "rowmax", "logsoftmaxnll", kernelSource, "rowmax");
+  CLKernel *rowsumKernel = kernelBuilder.buildKernel(uniqueName + "rowsum", "logsoftmaxnll", kernelSource, "rowsum");
+  CLKernel *expsubKernel = kernelBuilder.buildKernel(uniqueName + "expsub", "logsoftmaxnll", kernelSource, "expsub");
+  CLKernel *logdivKernel = kernelBuilder.buildKernel(uniqueName + "logdiv", "logsoftmaxnll", kernelSource, "logdiv");
+  CLKernel *nllKernel = kernelBuilder.buildKernel(uniqueName + "nll", "logsoftmaxnll", kernelSource, "nll");
+  CLKernel *meanKernel = kernelBuilder.buildKernel(uniqueName + "mean", "logsoftmaxnll", kernelSource, "mean");
+  CLKernel *fusedKernel = kernelBuilder.buildKernel(uniqueName + "fused", "logsoftmaxnll", kernelSource, "fused");
+  const int applyWorkgroupSize = 64;
+  int applyWorkgroups = (totalN + applyWorkgroupSize - 1) / applyWorkgroupSize;
+  int rowWorkgroups = (B + applyWorkgroupSize - 1) / applyWorkgroupSize;
+
+  float *in = new float[totalN];
+  float *logprobs = new float[totalN];
+  float *target = new float[B];
+  float *rowMax = new float[B];
+  float *rowSum = new float[B];
+  float *rowLoss = new float[B];
+  float loss[1];
+  for( int i = 0; i < totalN; i++ ) {
+    in[i] = ((i * 37) % 101) / 10.0f - 5.0f;
+  }
+  for( int row = 0; row < B; row++ ) {
+    target[row] = (row * 13) % V;
+  }
+  CLWrapper *inwrap = cl->wrap(totalN, in);
+  CLWrapper *logprobswrap = cl->wrap(totalN, logprobs);
+  CLWrapper *targetwrap = cl->wrap(B, target);
+  CLWrapper *rowMaxwrap = cl->wrap(B, rowMax);
+  CLWrapper *rowSumwrap = cl->wrap(B, rowSum);
+  CLWrapper *rowLosswrap = cl->wrap(B, rowLoss);
+  CLWrapper *losswrap = cl->wrap(1, loss);
+  memoryCopyToDevice(inwrap);
+  memoryCopyToDevice(targetwrap);
+  memoryCreateOnDevice(logprobswrap);
+  memoryCreateOnDevice(rowMaxwrap);
+  memoryCreateOnDevice(rowSumwrap);
+  memoryCreateOnDevice(rowLosswrap);
+  memoryCreateOnDevice(losswrap);
+
+  long long numLaunches = 0;
+  long long numSyncs = 0;
+  auto step = [&]() {
+    if(mode == "unfused") {
+      rowmaxKernel->in(V)->in(inwrap)->out(rowMaxwrap);
+      rowmaxKernel->run_1d(B * workgroupSize, workgroupSize);
+      expsubKernel->in(totalN)->in(V)->in(inwrap)->in(rowMaxwrap)->out(logprobswrap);
+      expsubKernel->run_1d(applyWorkgroups * applyWorkgroupSize, applyWorkgroupSize);
+      rowsumKernel->in(V)->in(logprobswrap)->out(rowSumwrap);
+      rowsumKernel->run_1d(B * workgroupSize, workgroupSize);
+      logdivKernel->in(totalN)->in(V)->in(rowSumwrap)->inout(logprobswrap);
+      logdivKernel->run_1d(applyWorkgroups * applyWorkgroupSize, applyWorkgroupSize);
+      nllKernel->in(B)->in(V)->in(logprobswrap)->in(targetwrap)->out(rowLosswrap);
+      nllKernel->run_1d(rowWorkgroups * applyWorkgroupSize, applyWorkgroupSize);
+      meanKernel->in(B)->in(rowLosswrap)->out(losswrap);
+      meanKernel->run_1d(workgroupSize, workgroupSize);
+      memoryCopyToHost(losswrap);
+      numLaunches += 6;
+      numSyncs++;
+    } else {
+      fusedKernel->in(V)->in(inwrap)->in(targetwrap)->out(logprobswrap)->out(rowLosswrap);
+      fusedKernel->run_1d(B * workgroupSize, workgroupSize);
+      meanKernel->in(B)->in(rowLosswrap)->out(losswrap);
+      meanKernel->run_1d(workgroupSize, workgroupSize);
+      numLaunches += 2;
+    }
+  };
+
+  cl->finish();
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for(int it = 0; it < batchSize; it++) {
+      step();
+    }
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  long long steps = result.totalLaunches;
+  // one read of the logits and one write of the logprobs is all thats needed
+  double bytes = 2.0 * totalN * sizeof(float);
+  cout << "logsoftmaxnll B=" << B << " V=" << V << " mode=" << mode << " exp=" << expFunction
+    << " workgroupsize=" << workgroupSize
+    << " launches/step=" << numLaunches / steps << " syncs/step=" << numSyncs / steps
+    << adaptiveString(result)
+    << rooflineString(result.median, bytes, (double)totalN);
+  string renderedSource = kernelBuilder.getRenderedKernel(kernelSource);
+  if(mode == "fused") {
+    cout << kernelResourceString(cl, renderedSource, "fused", workgroupSize);
+  } else {
+    cout << kernelResourceString(cl, renderedSource, "rowmax", workgroupSize)
+      << kernelResourceString(cl, renderedSource, "expsub", applyWorkgroupSize)
+      << kernelResourceString(cl, renderedSource, "rowsum", workgroupSize)
+      << kernelResourceString(cl, renderedSource, "logdiv", applyWorkgroupSize)
+      << kernelResourceString(cl, renderedSource, "nll", applyWorkgroupSize);
+  }
+  cout << kernelResourceString(cl, renderedSource, "mean", workgroupSize) << endl;
+
+  memoryCopyToHost(logprobswrap);
+  memoryCopyToHost(losswrap);
+  // native_exp precision is implementation-defined, so allow it more slack
+  double tolerance = expFunction == "native_exp" ? 0.01 : 0.0001;
+  int errorCount = 0;
+  double targetLoss = 0;
+  for( int row = 0; row < B; row++ ) {
+    double maxValue = in[row * V];
+    for( int i = 0; i < V; i++ ) {
+      maxValue = max(maxValue, (double)in[row * V + i]);
+    }
+    double sum = 0;
+    for( int i = 0; i < V; i++ ) {
+      sum += exp(in[row * V + i] - maxValue);
+    }
+    double logSum = log(sum) + maxValue;
+    for( int i = 0; i < V; i++ ) {
+      double targetValue = in[row * V + i] - logSum;
+      if(abs(logprobs[row * V + i] - targetValue) > tolerance * (1 + abs(targetValue))) {
+        errorCount++;
+        if( errorCount < 20 ) {
+          cout << "logprobs[" << row << "][" << i << "]=" << logprobs[row * V + i] << " != " << targetValue << endl;
+        }
+      }
+    }
+    targetLoss -= in[row * V + (int)target[row]] - logSum;
+  }
+  targetLoss /= B;
+  if(abs(loss[0] - targetLoss) > tolerance * (1 + abs(targetLoss))) {
+    errorCount++;
+    cout << "loss=" << loss[0] << " != " << targetLoss << endl;
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(inwrap);
+  memoryDelete(logprobswrap);
+  memoryDelete(targetwrap);
+  memoryDelete(rowMaxwrap);
+  memoryDelete(rowSumwrap);
+  memoryDelete(rowLosswrap);
+  memoryDelete(losswrap);
+  delete[] in;
+  delete[] logprobs;
+  delete[] target;
+  delete[] rowMax;
+  delete[] rowSum;
+  delete[] rowLoss;
+}
+
+void testShape(EasyCL *cl, int B, int V) {
+  test(cl, B, V, "unfused", "exp", 64);
+  test(cl, B, V, "unfused", "native_exp", 64);
+  test(cl, B, V, "fused", "exp", 64);
+  test(cl, B, V, "fused", "native_exp", 64);
+  test(cl, B, V, "fused", "native_exp", 256);
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  // batch 50, char-rnn's vocab of about 65, then word-level sized vocabs,
+  // then a whole 50-step sequence at once
+  testShape(cl, 50, 65);
+  testShape(cl, 50, 1000);
+  testShape(cl, 50, 10000);
+  testShape(cl, 2500, 65);
+  delete cl;
+  return 0;
+}
+
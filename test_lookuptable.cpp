@@ -0,0 +1,392 @@
+#include <iostream>
+#include <cmath>
+#include <set>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "templates/TemplatedKernel.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// embedding lookup, ie LookupTable, where the addressing comes from an index
+// tensor, rather than from linearId:
+// - forward, gather: out[b] = weight[index[b]], one row of width D per index
+// - backward, scatter-add: gradWeight[index[b]] += gradOutput[b], where
+//   several b can hit the same row
+//
+// gather modes:
+// - rowperitem: one work item copies a whole row
+// - rowpergroup: one workgroup per row, consecutive work items reading
+//   consecutive elements
+// each with float and float4
+//
+// scatter modes:
+// - atomic: one work item per element of gradOutput, adding into gradWeight
+//   with a compare-and-swap loop, since opencl 1.x has no float atomic add
+// - sort: bitonic sort of (index, b) pairs on the device, then each work item
+//   that starts a run of equal indices sums the run for one column, and adds
+//   it in with a plain read-modify-write.  the sort is timed too, since the
+//   indices change every batch
+//
+// duplicate rate is the fraction of indices drawn from a hot set of 4 rows,
+// the rest being uniform over the vocab
+
+static const char *kernelSource = R"DELIM(
+  kernel void gatherItem(int B, int D, global const int *index, global const {{type}} *weight, global {{type}} *out) {
+    int b = get_global_id(0);
+    if(b < B) {
+      global const {{type}} *weightRow = weight + index[b] * D;
+      global {{type}} *outRow = out + b * D;
+      for(int d = 0; d < D; d++) {
+        outRow[d] = weightRow[d];
+      }
+    }
+  }
+
+  kernel void gatherGroup(int D, global const int *index, global const {{type}} *weight, global {{type}} *out) {
+    int b = get_group_id(0);
+    global const {{type}} *weightRow = weight + index[b] * D;
+    global {{type}} *outRow = out + b * D;
+    for(int d = get_local_id(0); d < D; d += get_local_size(0)) {
+      outRow[d] = weightRow[d];
+    }
+  }
+
+  void atomicAddFloat(volatile global float *address, float value) {
+    union { unsigned int u; float f; } oldValue, newValue;
+    do {
+      oldValue.f = *address;
+      newValue.f = oldValue.f + value;
+    } while(atomic_cmpxchg((volatile global unsigned int *)address, oldValue.u, newValue.u) != oldValue.u);
+  }
+
+  kernel void scatterAtomic(int totalN, int D, global const int *index, global const float *gradOutput, global float *gradWeight) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      int b = linearId / D;
+      int d = linearId % D;
+      atomicAddFloat(gradWeight + index[b] * D + d, gradOutput[linearId]);
+    }
+  }
+
+  // pads to the power of two n with INT_MAX keys, which sort to the end
+  kernel void sortInit(int B, int n, global const int *index, global int *keys, global int *values) {
+    int i = get_global_id(0);
+    if(i < n) {
+      keys[i] = i < B ? index[i] : INT_MAX;
+      values[i] = i;
+    }
+  }
+
+  kernel void bitonicStep(int j, int k, global int *keys, global int *values) {
+    int i = get_global_id(0);
+    int ixj = i ^ j;
+    if(ixj > i) {
+      int keyI = keys[i];
+      int keyIxj = keys[ixj];
+      bool ascending = (i & k) == 0;
+      if((keyI > keyIxj) == ascending) {
+        keys[i] = keyIxj;
+        keys[ixj] = keyI;
+        int value = values[i];
+        values[i] = values[ixj];
+        values[ixj] = value;
+      }
+    }
+  }
+
+  kernel void segmentReduce(int B, int D, global const int *keys, global const int *values,
+      global const float *gradOutput, global float *gradWeight) {
+    int linearId = get_global_id(0);
+    int i = linearId / D;
+    int d = linearId % D;
+    if(i < B && (i == 0 || keys[i] != keys[i - 1])) {
+      int key = keys[i];
+      float sum = 0;
+      for(int j = i; j < B && keys[j] == key; j++) {
+        sum += gradOutput[values[j] * D + d];
+      }
+      gradWeight[key * D + d] += sum;
+    }
+  }
+)DELIM";
+
+// returns number of distinct indices
+int makeIndices(int B, int V, double duplicateRate, int *index) {
+  unsigned int seed = 123;
+  set<int> distinct;
+  for( int b = 0; b < B; b++ ) {
+    seed = seed * 1103515245 + 12345;
+    double r = (seed >> 8) / (double)(1 << 24);
+    seed = seed * 1103515245 + 12345;
+    if(r < duplicateRate) {
+      index[b] = (seed >> 8) % 4;
+    } else {
+      index[b] = (seed >> 8) % V;
+    }
+    distinct.insert(index[b]);
+  }
+  return distinct.size();
+}
+
+void testGather(EasyCL *cl, int B, int V, int D, double duplicateRate, string mode, int vectorSize) {
+  resetMemoryStats();
+  string type = "float";
+  if(vectorSize > 1) {
+    type += easycl::toString(vectorSize);
+  }
+  TemplatedKernel kernelBuilder(cl);
+  kernelBuilder.set("type", type);
+  string kernelName = mode == "rowperitem" ? "gatherItem" : "gatherGroup";
+  CLKernel *kernel = kernelBuilder.buildKernel("lookuptable_" + kernelName + "_" + type, "lookuptable", kernelSource, kernelName);
+  const int workgroupSize = 64;
+  int numWorkgroups = mode == "rowperitem" ? (B + workgroupSize - 1) / workgroupSize : B;
+
+  int *index = new int[B];
+  makeIndices(B, V, duplicateRate, index);
+  float *weight = new float[V * D];
+  float *out = new float[B * D];
+  for( int i = 0; i < V * D; i++ ) {
+    weight[i] = (i + 4) % 1000;
+  }
+  CLWrapper *indexwrap = cl->wrap(B, index);
+  CLWrapper *weightwrap = cl->wrap(V * D, weight);
+  CLWrapper *outwrap = cl->wrap(B * D, out);
+  memoryCopyToDevice(indexwrap);
+  memoryCopyToDevice(weightwrap);
+  memoryCreateOnDevice(outwrap);
+
+  cl->finish();
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for(int it = 0; it < batchSize; it++) {
+      if(mode == "rowperitem") {
+        kernel->in(B);
+      }
+      kernel->in(D / vectorSize);
+      kernel->in(indexwrap);
+      kernel->in(weightwrap);
+      kernel->out(outwrap);
+      kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    }
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  double bytes = ((double)B * sizeof(int) + 2.0 * B * D * sizeof(float));
+  cout << "gather B=" << B << " V=" << V << " D=" << D << " duprate=" << duplicateRate
+    << " mode=" << mode << " vectorsize=" << vectorSize << adaptiveString(result)
+    << rooflineString(result.median, bytes, 0)
+    << kernelResourceString(cl, kernelBuilder.getRenderedKernel(kernelSource), kernelName, workgroupSize) << endl;
+
+  memoryCopyToHost(outwrap);
+  int errorCount = 0;
+  for( int b = 0; b < B; b++ ) {
+    for( int d = 0; d < D; d++ ) {
+      if(out[b * D + d] != weight[index[b] * D + d]) {
+        errorCount++;
+        if( errorCount < 20 ) {
+          cout << "out[" << b << "][" << d << "]=" << out[b * D + d] << " != " << weight[index[b] * D + d] << endl;
+        }
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of " << B * D << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(indexwrap);
+  memoryDelete(weightwrap);
+  memoryDelete(outwrap);
+  delete[] index;
+  delete[] weight;
+  delete[] out;
+}
+
+void testScatter(EasyCL *cl, int B, int V, int D, double duplicateRate, string mode) {
+  resetMemoryStats();
+  TemplatedKernel kernelBuilder(cl);
+  kernelBuilder.set("type", "float");
+  CLKernel *atomicKernel = kernelBuilder.buildKernel("lookuptable_scatterAtomic", "lookuptable", kernelSource, "scatterAtomic");
+  CLKernel *sortInitKernel = kernelBuilder.buildKernel("lookuptable_sortInit", "lookuptable", kernelSource, "sortInit");
+  CLKernel *bitonicKernel = kernelBuilder.buildKernel("lookuptable_bitonicStep", "lookuptable", kernelSource, "bitonicStep");
+  CLKernel *segmentKernel = kernelBuilder.buildKernel("lookuptable_segmentReduce", "lookuptable", kernelSource, "segmentReduce");
+  const int workgroupSize = 64;
+  int totalN = B * D;
+  int numWorkgroups = (totalN + workgroupSize - 1) / workgroupSize;
+  int sortN = workgroupSize;
+  while(sortN < B) {
+    sortN <<= 1;
+  }
+
+  int *index = new int[B];
+  int numDistinct = makeIndices(B, V, duplicateRate, index);
+  float *gradOutput = new float[totalN];
+  float *gradWeight = new float[V * D];
+  int *keys = new int[sortN];
+  int *values = new int[sortN];
+  for( int i = 0; i < totalN; i++ ) {
+    gradOutput[i] = ((i + 4) % 100) / 100.0f;
+  }
+  for( int i = 0; i < V * D; i++ ) {
+    gradWeight[i] = 0;
+  }
+  CLWrapper *indexwrap = cl->wrap(B, index);
+  CLWrapper *gradOutputwrap = cl->wrap(totalN, gradOutput);
+  CLWrapper *gradWeightwrap = cl->wrap(V * D, gradWeight);
+  CLWrapper *keyswrap = cl->wrap(sortN, keys);
+  CLWrapper *valueswrap = cl->wrap(sortN, values);
+  memoryCopyToDevice(indexwrap);
+  memoryCopyToDevice(gradOutputwrap);
+  memoryCopyToDevice(gradWeightwrap);
+  if(mode == "sort") {
+    memoryCreateOnDevice(keyswrap);
+    memoryCreateOnDevice(valueswrap);
+  }
+
+  long long numLaunches = 0;
+  auto launch = [&]() {
+    if(mode == "atomic") {
+      atomicKernel->in(totalN);
+      atomicKernel->in(D);
+      atomicKernel->in(indexwrap);
+      atomicKernel->in(gradOutputwrap);
+      atomicKernel->inout(gradWeightwrap);
+      atomicKernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+      numLaunches++;
+    } else {
+      sortInitKernel->in(B);
+      sortInitKernel->in(sortN);
+      sortInitKernel->in(indexwrap);
+      sortInitKernel->out(keyswrap);
+      sortInitKernel->out(valueswrap);
+      sortInitKernel->run_1d(sortN, workgroupSize);
+      numLaunches++;
+      for( int k = 2; k <= sortN; k <<= 1 ) {
+        for( int j = k >> 1; j > 0; j >>= 1 ) {
+          bitonicKernel->in(j);
+          bitonicKernel->in(k);
+          bitonicKernel->inout(keyswrap);
+          bitonicKernel->inout(valueswrap);
+          bitonicKernel->run_1d(sortN, workgroupSize);
+          numLaunches++;
+        }
+      }
+      segmentKernel->in(B);
+      segmentKernel->in(D);
+      segmentKernel->in(keyswrap);
+      segmentKernel->in(valueswrap);
+      segmentKernel->in(gradOutputwrap);
+      segmentKernel->inout(gradWeightwrap);
+      segmentKernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+      numLaunches++;
+    }
+  };
+
+  cl->finish();
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for(int it = 0; it < batchSize; it++) {
+      launch();
+    }
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  // gradOutput read once, each distinct row of gradWeight read and written once
+  double bytes = ((double)B * sizeof(int) + ((double)totalN + 2.0 * numDistinct * D) * sizeof(float));
+  cout << "scatter B=" << B << " V=" << V << " D=" << D << " duprate=" << duplicateRate
+    << " distinct=" << numDistinct << " mode=" << mode
+    << " launches/it=" << numLaunches / result.totalLaunches << adaptiveString(result)
+    << rooflineString(result.median, bytes, (double)totalN);
+  string renderedSource = kernelBuilder.getRenderedKernel(kernelSource);
+  if(mode == "atomic") {
+    cout << kernelResourceString(cl, renderedSource, "scatterAtomic", workgroupSize);
+  } else {
+    cout << kernelResourceString(cl, renderedSource, "sortInit", workgroupSize)
+      << kernelResourceString(cl, renderedSource, "bitonicStep", workgroupSize)
+      << kernelResourceString(cl, renderedSource, "segmentReduce", workgroupSize);
+  }
+  cout << endl;
+
+  // timing accumulated into gradWeight many times, so zero it, and check one launch
+  for( int i = 0; i < V * D; i++ ) {
+    gradWeight[i] = 0;
+  }
+  memoryCopyToDevice(gradWeightwrap);
+  launch();
+  cl->finish();
+  memoryCopyToHost(gradWeightwrap);
+  float *targetGradWeight = new float[V * D];
+  for( int i = 0; i < V * D; i++ ) {
+    targetGradWeight[i] = 0;
+  }
+  for( int b = 0; b < B; b++ ) {
+    for( int d = 0; d < D; d++ ) {
+      targetGradWeight[index[b] * D + d] += gradOutput[b * D + d];
+    }
+  }
+  int errorCount = 0;
+  for( int i = 0; i < V * D; i++ ) {
+    // summation order differs, and hot rows sum thousands of values
+    if(abs(gradWeight[i] - targetGradWeight[i]) > 0.0001f * (1 + abs(targetGradWeight[i]))) {
+      errorCount++;
+      if( errorCount < 20 ) {
+        cout << "gradWeight[" << i / D << "][" << i % D << "]=" << gradWeight[i] << " != " << targetGradWeight[i] << endl;
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of " << V * D << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(indexwrap);
+  memoryDelete(gradOutputwrap);
+  memoryDelete(gradWeightwrap);
+  memoryDelete(keyswrap);
+  memoryDelete(valueswrap);
+  delete[] index;
+  delete[] gradOutput;
+  delete[] gradWeight;
+  delete[] targetGradWeight;
+  delete[] keys;
+  delete[] values;
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  // a whole sequence, 50 steps of batch 50, looked up at once
+  const int B = 50 * 50;
+  const int vocabSizes[] = { 65, 10000, 100000 };
+  const int widths[] = { 128, 512 };
+  const double duplicateRates[] = { 0, 0.5, 0.95 };
+  for( int v = 0; v < 3; v++ ) {
+    for( int w = 0; w < 2; w++ ) {
+      for( int r = 0; r < 3; r++ ) {
+        int V = vocabSizes[v];
+        int D = widths[w];
+        double duplicateRate = duplicateRates[r];
+        testGather(cl, B, V, D, duplicateRate, "rowperitem", 1);
+        testGather(cl, B, V, D, duplicateRate, "rowperitem", 4);
+        testGather(cl, B, V, D, duplicateRate, "rowpergroup", 1);
+        testGather(cl, B, V, D, duplicateRate, "rowpergroup", 4);
+        testScatter(cl, B, V, D, duplicateRate, "atomic");
+        testScatter(cl, B, V, D, duplicateRate, "sort");
+      }
+    }
+  }
+  delete cl;
+  return 0;
+}
+
@@ -0,0 +1,226 @@
+#include <iostream>
+#include <cmath>
+#include <stdexcept>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// throughput and accuracy of the transcendental and activation functions
+// that char-rnn's pointwise ops use, across precision modes and vector widths
+//
+// functions: exp, log, tanh, sigmoid, pow (to the 1.7), sqrt, rsqrt, plus
+// none, which is just the loop and the adds, ie the overhead included in
+// every other function's rate
+//
+// modes:
+// - precise: the builtins, eg exp(x), 1.0f / (1.0f + exp(-x))
+// - native: native_exp, native_log, native_powr, native_sqrt, native_rsqrt.
+//   there is no native_tanh, so tanh is built from native_exp
+// - fastmath: the precise forms, built with -cl-fast-relaxed-math
+//
+// throughput: each work item runs 4 independent chains of its evaluations,
+// with the argument moving on each iteration so nothing can be hoisted, and
+// reads and writes one element, so the kernel is compute-bound.  the total
+// number of evaluations per launch is the same for each vector width
+//
+// accuracy: one evaluation per element over a range of inputs suited to the
+// function, compared against the cpu in double, as max ulp error relative to
+// the correctly rounded float result
+
+static const char *kernelSource = R"DELIM(
+  #define FUNC(x) {{func}}
+
+  kernel void throughput(int its, float step, global TYPE *out, global const TYPE *in) {
+    int id = get_global_id(0);
+    TYPE x0 = in[id];
+    TYPE x1 = x0 + 0.25f;
+    TYPE x2 = x0 + 0.5f;
+    TYPE x3 = x0 + 0.75f;
+    TYPE acc = 0.0f;
+    for(int i = 0; i < its; i++) {
+      acc += FUNC(x0) + FUNC(x1) + FUNC(x2) + FUNC(x3);
+      x0 += step;
+      x1 += step;
+      x2 += step;
+      x3 += step;
+    }
+    out[id] = acc;
+  }
+
+  kernel void accuracy(global TYPE *out, global const TYPE *in) {
+    int id = get_global_id(0);
+    out[id] = FUNC(in[id]);
+  }
+)DELIM";
+
+string functionExpression(string function, string mode) {
+  bool native = mode == "native";
+  if(function == "none") {
+    return "(x)";
+  } else if(function == "exp") {
+    return native ? "native_exp(x)" : "exp(x)";
+  } else if(function == "log") {
+    return native ? "native_log(x)" : "log(x)";
+  } else if(function == "tanh") {
+    return native ? "(1.0f - 2.0f / (native_exp(2.0f * (x)) + 1.0f))" : "tanh(x)";
+  } else if(function == "sigmoid") {
+    return native ? "native_recip(1.0f + native_exp(-(x)))" : "(1.0f / (1.0f + exp(-(x))))";
+  } else if(function == "pow") {
+    return native ? "native_powr(x, (TYPE)(1.7f))" : "pow(x, (TYPE)(1.7f))";
+  } else if(function == "sqrt") {
+    return native ? "native_sqrt(x)" : "sqrt(x)";
+  } else if(function == "rsqrt") {
+    return native ? "native_rsqrt(x)" : "rsqrt(x)";
+  }
+  throw runtime_error("unknown function " + function);
+}
+
+double reference(string function, double x) {
+  if(function == "none") {
+    return x;
+  } else if(function == "exp") {
+    return exp(x);
+  } else if(function == "log") {
+    return log(x);
+  } else if(function == "tanh") {
+    return tanh(x);
+  } else if(function == "sigmoid") {
+    return 1.0 / (1.0 + exp(-x));
+  } else if(function == "pow") {
+    return pow(x, 1.7);
+  } else if(function == "sqrt") {
+    return sqrt(x);
+  } else if(function == "rsqrt") {
+    return 1.0 / sqrt(x);
+  }
+  throw runtime_error("unknown function " + function);
+}
+
+// accuracy inputs, within the domain, and covering where the function does
+// something interesting
+void inputRange(string function, float *lo, float *hi) {
+  if(function == "log" || function == "sqrt" || function == "rsqrt") {
+    *lo = 0.001f;
+    *hi = 1000.0f;
+  } else if(function == "pow") {
+    *lo = 0.01f;
+    *hi = 10.0f;
+  } else {
+    *lo = -10.0f;
+    *hi = 10.0f;
+  }
+}
+
+// distance from the reference, in units of the spacing of floats around the
+// correctly rounded reference
+double ulpError(float value, double target) {
+  float rounded = fabs((float)target);
+  double ulp = nextafterf(rounded, INFINITY) - rounded;
+  if(std::isinf(ulp)) {
+    return value == (float)target ? 0 : INFINITY;
+  }
+  return fabs(value - target) / ulp;
+}
+
+void test(EasyCL *cl, string function, string mode, int vectorSize) {
+  resetMemoryStats();
+  string type = "float";
+  if(vectorSize > 1) {
+    type += easycl::toString(vectorSize);
+  }
+  string templatedSource = easycl::replace(kernelSource, "{{func}}", functionExpression(function, mode));
+  templatedSource = "#define TYPE " + type + "\n" + templatedSource;
+  string options = mode == "fastmath" ? "-cl-fast-relaxed-math" : "";
+  CLKernel *throughputKernel = cl->buildKernelFromString(templatedSource, "throughput", options);
+  CLKernel *accuracyKernel = cl->buildKernelFromString(templatedSource, "accuracy", options);
+  const int workgroupSize = 64;
+  const int totalN = 1024 * 1024;
+  const int its = 256;
+  int numWorkItems = totalN / vectorSize;
+
+  float lo, hi;
+  inputRange(function, &lo, &hi);
+  float *in = new float[totalN];
+  float *out = new float[totalN];
+  for( int i = 0; i < totalN; i++ ) {
+    in[i] = lo + (hi - lo) * i / (totalN - 1);
+  }
+  CLWrapper *inwrap = cl->wrap(totalN, in);
+  CLWrapper *outwrap = cl->wrap(totalN, out);
+  memoryCopyToDevice(inwrap);
+  memoryCreateOnDevice(outwrap);
+
+  accuracyKernel->out(outwrap);
+  accuracyKernel->in(inwrap);
+  accuracyKernel->run_1d(numWorkItems, workgroupSize);
+  memoryCopyToHost(outwrap);
+  double maxUlp = 0;
+  float maxUlpInput = 0;
+  for( int i = 0; i < totalN; i++ ) {
+    double error = ulpError(out[i], reference(function, in[i]));
+    if(!(error <= maxUlp)) {
+      maxUlp = error;
+      maxUlpInput = in[i];
+    }
+  }
+
+  // throughput inputs start within [0.5, 1.5], which stays inside every
+  // function's domain as the chains move on
+  for( int i = 0; i < totalN; i++ ) {
+    in[i] = 0.5f + (i % 1024) / 1024.0f;
+  }
+  memoryCopyToDevice(inwrap);
+  const float step = 0.0001f;
+  cl->finish();
+  AdaptiveResult result = measureAdaptive([&]() {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    throughputKernel->in(its);
+    throughputKernel->in(step);
+    throughputKernel->out(outwrap);
+    throughputKernel->in(inwrap);
+    throughputKernel->run_1d(numWorkItems, workgroupSize);
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  double evaluations = (double)totalN * its * 4;
+  cout << "math function=" << function << " mode=" << mode << " type=" << type << adaptiveString(result)
+    << " Gops/s=" << evaluations / result.median / 1000.0 / 1000.0
+    << " maxulp=" << maxUlp << " at x=" << maxUlpInput
+    << rooflineString(result.median, (double)totalN * 2 * sizeof(float), 0)
+    << kernelResourceString(cl, templatedSource, "throughput", workgroupSize, options) << endl;
+
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(inwrap);
+  memoryDelete(outwrap);
+  delete throughputKernel;
+  delete accuracyKernel;
+  delete[] in;
+  delete[] out;
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  string functions[] = { "none", "exp", "log", "tanh", "sigmoid", "pow", "sqrt", "rsqrt" };
+  string modes[] = { "precise", "native", "fastmath" };
+  for( int f = 0; f < 8; f++ ) {
+    for( int m = 0; m < 3; m++ ) {
+      for( int vectorSize = 1; vectorSize <= 8; vectorSize *= 2 ) {
+        test(cl, functions[f], modes[m], vectorSize);
+      }
+    }
+  }
+  delete cl;
+  return 0;
+}
@@ -0,0 +1,289 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <thread>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "kernelresources.h"
+
+// one large apply split across every OpenCL device in the machine, eg an
+// intel igpu, an nvidia dgpu, and a cpu runtime
+//
+// the tensor is 128M floats, as in test_apply1 and test_applystrided, seen as
+// rows of 32.  it lives on the host, and each round every device takes a
+// contiguous block of rows: uploads it, runs the apply, downloads it, each
+// from its own host thread.  shares start equal, then after each round are
+// set in proportion to each device's measured rows per ms, smoothed over
+// rounds, so the split rebalances as the run goes
+//
+// workloads:
+// - apply1: out = out + 1, in storage order
+// - applystrided: the same, but visiting the block column by column, ie
+//   test_applystrided's transposed case, with size1 32
+//
+// the single-device runs go through the same host-resident path, with the
+// whole tensor on one device, so the comparison includes transfers either way
+
+static const char *kernelSource = R"DELIM(
+  kernel void apply1(int numRows, global float *out) {
+    int linearId = get_global_id(0);
+    if(linearId < numRows * 32) {
+      out[linearId] = out[linearId] + 1.0f;
+    }
+  }
+
+  kernel void applystrided(int numRows, global float *out) {
+    int linearId = get_global_id(0);
+    if(linearId < numRows * 32) {
+      int x0 = linearId % numRows;
+      int x1 = linearId / numRows;
+      int offset = x0 * 32 + x1;
+      out[offset] = out[offset] + 1.0f;
+    }
+  }
+)DELIM";
+
+typedef struct Device {
+  EasyCL *cl;
+  string name;
+  cl_program program;
+  cl_kernel kernels[2];
+  cl_mem buffer;
+  int maxRows;
+  // smoothed over rounds
+  double rowsPerMs;
+  // this round
+  int rowStart;
+  int numRows;
+  double milliseconds;
+} Device;
+
+Device *createDevice(int platformIndex, int deviceIndex, int totalRows) {
+  Device *device = new Device();
+  device->cl = EasyCL::createForPlatformDeviceIndexes(platformIndex, deviceIndex);
+  EasyCL *cl = device->cl;
+  char name[256];
+  clGetDeviceInfo(cl->device, CL_DEVICE_NAME, sizeof(name), name, 0);
+  device->name = name;
+  cl_int err;
+  const char *source = kernelSource;
+  device->program = clCreateProgramWithSource(*cl->context, 1, &source, 0, &err);
+  EasyCL::checkError(err);
+  EasyCL::checkError(clBuildProgram(device->program, 1, &cl->device, "", 0, 0));
+  device->kernels[0] = clCreateKernel(device->program, "apply1", &err);
+  EasyCL::checkError(err);
+  device->kernels[1] = clCreateKernel(device->program, "applystrided", &err);
+  EasyCL::checkError(err);
+  cl_ulong maxAllocBytes = 0;
+  EasyCL::checkError(clGetDeviceInfo(cl->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAllocBytes), &maxAllocBytes, 0));
+  device->maxRows = (int)min((cl_ulong)totalRows, maxAllocBytes / (32 * sizeof(float)));
+  size_t bytes = (size_t)device->maxRows * 32 * sizeof(float);
+  device->buffer = clCreateBuffer(*cl->context, CL_MEM_READ_WRITE, bytes, 0, &err);
+  EasyCL::checkError(err);
+  return device;
+}
+
+void deleteDevice(Device *device) {
+  clReleaseMemObject(device->buffer);
+  clReleaseKernel(device->kernels[0]);
+  clReleaseKernel(device->kernels[1]);
+  clReleaseProgram(device->program);
+  delete device->cl;
+  delete device;
+}
+
+// runs on the device's own thread
+void runShare(Device *device, int kernelIndex, float *host) {
+  double start = StatefulTimer::instance()->getSystemMilliseconds();
+  if(device->numRows > 0) {
+    cl_command_queue queue = *device->cl->queue;
+    size_t bytes = (size_t)device->numRows * 32 * sizeof(float);
+    float *hostBlock = host + (size_t)device->rowStart * 32;
+    EasyCL::checkError(clEnqueueWriteBuffer(queue, device->buffer, CL_FALSE, 0, bytes, hostBlock, 0, 0, 0));
+    cl_kernel kernel = device->kernels[kernelIndex];
+    EasyCL::checkError(clSetKernelArg(kernel, 0, sizeof(device->numRows), &device->numRows));
+    EasyCL::checkError(clSetKernelArg(kernel, 1, sizeof(device->buffer), &device->buffer));
+    const int workgroupSize = 64;
+    size_t global = (((size_t)device->numRows * 32 + workgroupSize - 1) / workgroupSize) * workgroupSize;
+    size_t local = workgroupSize;
+    EasyCL::checkError(clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global, &local, 0, 0, 0));
+    EasyCL::checkError(clEnqueueReadBuffer(queue, device->buffer, CL_TRUE, 0, bytes, hostBlock, 0, 0, 0));
+  }
+  device->milliseconds = StatefulTimer::instance()->getSystemMilliseconds() - start;
+}
+
+// shares in proportion to rowsPerMs, within each device's maxRows
+void partition(const vector<Device *> &devices, int totalRows) {
+  double totalRate = 0;
+  for( int i = 0; i < (int)devices.size(); i++ ) {
+    totalRate += devices[i]->rowsPerMs;
+  }
+  int assigned = 0;
+  for( int i = 0; i < (int)devices.size(); i++ ) {
+    Device *device = devices[i];
+    device->numRows = min(device->maxRows, (int)(totalRows * (device->rowsPerMs / totalRate)));
+    assigned += device->numRows;
+  }
+  // rounding, and anything over a device's cap, goes to whoever has room
+  for( int i = 0; i < (int)devices.size() && assigned < totalRows; i++ ) {
+    int extra = min(totalRows - assigned, devices[i]->maxRows - devices[i]->numRows);
+    devices[i]->numRows += extra;
+    assigned += extra;
+  }
+  int rowStart = 0;
+  for( int i = 0; i < (int)devices.size(); i++ ) {
+    devices[i]->rowStart = rowStart;
+    rowStart += devices[i]->numRows;
+  }
+}
+
+// returns elements per ms, from the median of the second half of the rounds,
+// once the split has settled
+double test(const vector<Device *> &devices, string workload, int totalRows, int rounds, string label) {
+  resetMemoryStats();
+  int kernelIndex = workload == "apply1" ? 0 : 1;
+  long long totalN = (long long)totalRows * 32;
+  float *host = new float[totalN];
+  for( long long i = 0; i < totalN; i++ ) {
+    host[i] = i % 1000;
+  }
+  int capacity = 0;
+  for( int i = 0; i < (int)devices.size(); i++ ) {
+    devices[i]->rowsPerMs = 1;
+    capacity += devices[i]->maxRows;
+  }
+  if(capacity < totalRows) {
+    cout << "workload=" << workload << " devices=" << label << ": not enough device memory, skipping" << endl;
+    delete[] host;
+    return 0;
+  }
+  // every device's buffer lives for the whole process, but only the devices
+  // in this run count towards its devicepeak
+  double deviceBytes = 0;
+  for( int i = 0; i < (int)devices.size(); i++ ) {
+    deviceBytes += (double)devices[i]->maxRows * 32 * sizeof(float);
+  }
+  memoryRawAllocated(deviceBytes);
+
+  vector<double> roundTimes;
+  for( int round = 0; round < rounds; round++ ) {
+    partition(devices, totalRows);
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    vector<thread> threads;
+    for( int i = 0; i < (int)devices.size(); i++ ) {
+      threads.push_back(thread(runShare, devices[i], kernelIndex, host));
+    }
+    for( int i = 0; i < (int)threads.size(); i++ ) {
+      threads[i].join();
+    }
+    double roundTime = StatefulTimer::instance()->getSystemMilliseconds() - start;
+    roundTimes.push_back(roundTime);
+    cout << "workload=" << workload << " devices=" << label << " round=" << round << " time=" << roundTime << "ms";
+    for( int i = 0; i < (int)devices.size(); i++ ) {
+      Device *device = devices[i];
+      cout << " [" << device->name << " rows=" << device->numRows << " " << device->milliseconds << "ms]";
+      if(device->numRows > 0) {
+        double measured = device->numRows / device->milliseconds;
+        device->rowsPerMs = round == 0 ? measured : 0.5 * device->rowsPerMs + 0.5 * measured;
+      }
+    }
+    cout << endl;
+    memoryRawCopied((double)totalN * sizeof(float), (double)totalN * sizeof(float));
+  }
+  vector<double> settled(roundTimes.begin() + rounds / 2, roundTimes.end());
+  sort(settled.begin(), settled.end());
+  double median = settled[settled.size() / 2];
+  cout << "workload=" << workload << " devices=" << label << " median=" << median << "ms"
+    << " elements/s=" << totalN / median * 1000
+    << rooflineString(median, (double)totalN * 2 * sizeof(float), (double)totalN);
+  for( int i = 0; i < (int)devices.size(); i++ ) {
+    cout << kernelResourceString(devices[i]->cl, devices[i]->kernels[kernelIndex], 64);
+  }
+  cout << endl;
+
+  long long errorCount = 0;
+  for( long long i = 0; i < totalN; i++ ) {
+    float targetValue = i % 1000 + rounds;
+    if(host[i] != targetValue) {
+      errorCount++;
+      if( errorCount < 20 ) {
+        cout << "host[" << i << "]=" << host[i] << " != " << targetValue << endl;
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+  memoryRawReleased(deviceBytes);
+
+  delete[] host;
+  return totalN / median;
+}
+
+int main(int argc, char *argv[]) {
+  const int totalRows = 128 * 1024 * 1024 / 32;
+  int gpu = 0;
+  int rounds = 10;
+  if( argc >= 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  if( argc >= 3 ) {
+    rounds = atoi(argv[2]);
+  }
+  // the median is over the second half of the rounds, so there has to be one
+  if( rounds < 2 ) {
+    cout << "rounds must be at least 2" << endl;
+    cout << "usage: test_multidevice [gpu] [rounds]" << endl;
+    return 1;
+  }
+  // peak fractions are relative to this gpu; the run itself uses every device
+  loadRooflinePeaks(gpu);
+
+  vector<Device *> devices;
+  cl_uint numPlatforms = 0;
+  EasyCL::checkError(clGetPlatformIDs(0, 0, &numPlatforms));
+  vector<cl_platform_id> platforms(numPlatforms);
+  EasyCL::checkError(clGetPlatformIDs(numPlatforms, &platforms[0], 0));
+  for( int p = 0; p < (int)numPlatforms; p++ ) {
+    cl_uint numDevices = 0;
+    if(clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, 0, &numDevices) != CL_SUCCESS) {
+      continue;
+    }
+    for( int d = 0; d < (int)numDevices; d++ ) {
+      Device *device = createDevice(p, d, totalRows);
+      cout << "device " << devices.size() << ": " << device->name << " maxrows=" << device->maxRows << endl;
+      devices.push_back(device);
+    }
+  }
+
+  string workloads[] = { "apply1", "applystrided" };
+  for( int w = 0; w < 2; w++ ) {
+    double bestSingle = 0;
+    string bestName = "";
+    for( int i = 0; i < (int)devices.size(); i++ ) {
+      vector<Device *> single(1, devices[i]);
+      double elementsPerMs = test(single, workloads[w], totalRows, rounds, devices[i]->name);
+      if(elementsPerMs > bestSingle) {
+        bestSingle = elementsPerMs;
+        bestName = devices[i]->name;
+      }
+    }
+    double combined = test(devices, workloads[w], totalRows, rounds, "all");
+    if(bestSingle > 0) {
+      cout << "workload=" << workloads[w] << " combined vs best single (" << bestName << ")="
+        << (int)(combined / bestSingle * 100) << "%" << endl;
+    }
+  }
+
+  for( int i = 0; i < (int)devices.size(); i++ ) {
+    deleteDevice(devices[i]);
+  }
+  return 0;
+}
+
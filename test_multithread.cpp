@@ -0,0 +1,305 @@
+#include <iostream>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <atomic>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "launchprofile.h"
+#include "kernelresources.h"
+
+// test_apply3's 6400-element launch, submitted from several host threads at
+// once, as a framework with data-loader and model threads would, to see
+// whether the driver serializes them
+//
+// modes:
+// - shared: every thread enqueues straight into one queue
+// - perthread: every thread enqueues into its own queue
+// - handoff: threads push launch requests into a lock-free queue, and one
+//   submitter thread pops them and does all the enqueueing, into one queue,
+//   so only one thread ever talks to the driver
+//
+// each thread has its own buffers, and its own cl_kernel, since
+// clSetKernelArg on a kernel shared between threads isnt safe
+//
+// reports launches per second over all threads, from releasing the threads
+// to the last launch finishing on the device, and per thread, the latency of
+// each submission, ie setting args and enqueueing, or, for handoff, the push,
+// via launchprofile.h
+//
+// test_multithread [gpu] [maxthreads], threads go 1, 2, 4 .. maxthreads,
+// default 8
+
+static const char *kernelSource = R"DELIM(
+  kernel void test(int totalN, global float*out, global float *in1, global float *in2) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out[linearId] = in1[linearId] * in2[linearId];
+    }
+  }
+)DELIM";
+
+typedef struct Launch {
+  cl_mem out;
+  cl_mem in1;
+  cl_mem in2;
+} Launch;
+
+// bounded multi-producer queue, after dmitry vyukov's: each cell carries a
+// sequence number, which says whether it is free for the producer at that
+// position, or full for the consumer, so a push or pop is one compare and
+// swap on the position, with no lock
+class HandoffQueue {
+public:
+  HandoffQueue(int capacity) :
+      cells(capacity),
+      mask(capacity - 1),
+      pushPosition(0),
+      popPosition(0) {
+    for( int i = 0; i < capacity; i++ ) {
+      cells[i].sequence.store(i, memory_order_relaxed);
+    }
+  }
+  // spins while full
+  void push(const Launch &launch) {
+    size_t position = pushPosition.load(memory_order_relaxed);
+    while(true) {
+      Cell *cell = &cells[position & mask];
+      size_t sequence = cell->sequence.load(memory_order_acquire);
+      if(sequence == position) {
+        if(pushPosition.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+          cell->launch = launch;
+          cell->sequence.store(position + 1, memory_order_release);
+          return;
+        }
+      } else if(sequence < position) {
+        this_thread::yield();
+        position = pushPosition.load(memory_order_relaxed);
+      } else {
+        position = pushPosition.load(memory_order_relaxed);
+      }
+    }
+  }
+  // single consumer; false if empty
+  bool pop(Launch *launch) {
+    size_t position = popPosition.load(memory_order_relaxed);
+    Cell *cell = &cells[position & mask];
+    if(cell->sequence.load(memory_order_acquire) != position + 1) {
+      return false;
+    }
+    *launch = cell->launch;
+    cell->sequence.store(position + mask + 1, memory_order_release);
+    popPosition.store(position + 1, memory_order_relaxed);
+    return true;
+  }
+
+protected:
+  typedef struct Cell {
+    atomic<size_t> sequence;
+    Launch launch;
+  } Cell;
+  vector<Cell> cells;
+  size_t mask;
+  atomic<size_t> pushPosition;
+  atomic<size_t> popPosition;
+};
+
+void setArg(cl_kernel kernel, int argIndex, int value) {
+  EasyCL::checkError(clSetKernelArg(kernel, argIndex, sizeof(value), &value));
+}
+
+void setArg(cl_kernel kernel, int argIndex, cl_mem buffer) {
+  EasyCL::checkError(clSetKernelArg(kernel, argIndex, sizeof(buffer), &buffer));
+}
+
+void enqueue(cl_command_queue queue, cl_kernel kernel, int totalN, const Launch &launch) {
+  const int workgroupSize = 64;
+  setArg(kernel, 0, totalN);
+  setArg(kernel, 1, launch.out);
+  setArg(kernel, 2, launch.in1);
+  setArg(kernel, 3, launch.in2);
+  size_t global = ((totalN + workgroupSize - 1) / workgroupSize) * workgroupSize;
+  size_t local = workgroupSize;
+  EasyCL::checkError(clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global, &local, 0, 0, 0));
+}
+
+void test(EasyCL *cl, cl_program program, int its, int size, int numThreads, string mode) {
+  resetMemoryStats();
+  int totalN = size;
+  cl_int err;
+  vector<cl_kernel> kernels(numThreads + 1);
+  for( int t = 0; t < numThreads + 1; t++ ) {
+    kernels[t] = clCreateKernel(program, "test", &err);
+    EasyCL::checkError(err);
+  }
+  vector<cl_command_queue> queues;
+  if(mode == "perthread") {
+    for( int t = 0; t < numThreads; t++ ) {
+      queues.push_back(clCreateCommandQueue(*cl->context, cl->device, 0, &err));
+      EasyCL::checkError(err);
+    }
+  } else {
+    queues.push_back(*cl->queue);
+  }
+
+  vector<float *> out(numThreads);
+  float *in1 = new float[totalN];
+  float *in2 = new float[totalN];
+  for( int i = 0; i < totalN; i++ ) {
+      in1[i] = (i + 4) % 1000000;
+      in2[i] = (i + 6) % 1000000;
+  }
+  vector<CLWrapper *> wrappers;
+  vector<Launch> launches(numThreads);
+  for( int t = 0; t < numThreads; t++ ) {
+    out[t] = new float[totalN];
+    CLWrapper *outwrap = cl->wrap(totalN, out[t]);
+    CLWrapper *in1wrap = cl->wrap(totalN, in1);
+    CLWrapper *in2wrap = cl->wrap(totalN, in2);
+    memoryCreateOnDevice(outwrap);
+    memoryCopyToDevice(in1wrap);
+    memoryCopyToDevice(in2wrap);
+    launches[t].out = outwrap->getBuffer();
+    launches[t].in1 = in1wrap->getBuffer();
+    launches[t].in2 = in2wrap->getBuffer();
+    wrappers.push_back(outwrap);
+    wrappers.push_back(in1wrap);
+    wrappers.push_back(in2wrap);
+  }
+  cl->finish();
+
+  vector<LaunchProfile> profiles(numThreads);
+  HandoffQueue handoff(1024);
+  double start = 0;
+  double end = 0;
+  // first pass warms up, second is the one reported
+  for( int pass = 0; pass < 2; pass++ ) {
+    atomic<bool> go(false);
+    vector<thread> threads;
+    for( int t = 0; t < numThreads; t++ ) {
+      profiles[t].clear();
+      threads.push_back(thread([&, t]() {
+        while(!go.load()) {
+          this_thread::yield();
+        }
+        string name = "thread" + easycl::toString(t);
+        cl_command_queue queue = queues[mode == "perthread" ? t : 0];
+        for( int it = 0; it < its; it++ ) {
+          profiles[t].start();
+          if(mode == "handoff") {
+            handoff.push(launches[t]);
+          } else {
+            enqueue(queue, kernels[t], totalN, launches[t]);
+          }
+          profiles[t].stamp(name, "submit");
+        }
+      }));
+    }
+    thread submitter;
+    if(mode == "handoff") {
+      submitter = thread([&]() {
+        while(!go.load()) {
+          this_thread::yield();
+        }
+        int remaining = numThreads * its;
+        Launch launch;
+        while(remaining > 0) {
+          if(handoff.pop(&launch)) {
+            enqueue(queues[0], kernels[numThreads], totalN, launch);
+            remaining--;
+          } else {
+            this_thread::yield();
+          }
+        }
+      });
+    }
+    start = StatefulTimer::instance()->getSystemMilliseconds();
+    go.store(true);
+    for( int t = 0; t < numThreads; t++ ) {
+      threads[t].join();
+    }
+    if(mode == "handoff") {
+      submitter.join();
+    }
+    for( int q = 0; q < (int)queues.size(); q++ ) {
+      clFinish(queues[q]);
+    }
+    end = StatefulTimer::instance()->getSystemMilliseconds();
+  }
+  int numLaunches = numThreads * its;
+  cout << "multithread mode=" << mode << " threads=" << numThreads << " its/thread=" << its << " size=" << size
+    << " time=" << (end - start) << "ms launches/s=" << numLaunches / (end - start) * 1000
+    << rooflineString(end - start, (double)numLaunches * totalN * 3 * sizeof(float), (double)numLaunches * totalN)
+    << kernelResourceString(cl, kernels[0], 64) << endl;
+  for( int t = 0; t < numThreads; t++ ) {
+    cout << profiles[t].report(" mode=" + mode + " threads=" + easycl::toString(numThreads));
+  }
+
+  int errorCount = 0;
+  for( int t = 0; t < numThreads; t++ ) {
+    memoryCopyToHost(wrappers[t * 3]);
+    for( int i = 0; i < totalN; i++ ) {
+      float targetValue = in1[i] * in2[i];
+      if(abs(out[t][i] - targetValue) > 0.1f) {
+        errorCount++;
+        if( errorCount < 20 ) {
+          cout << "thread " << t << " out[" << i << "]=" << out[t][i] << " != " << targetValue << endl;
+        }
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of " << numThreads * totalN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  for( int i = 0; i < (int)wrappers.size(); i++ ) {
+    memoryDelete(wrappers[i]);
+  }
+  for( int t = 0; t < numThreads; t++ ) {
+    delete[] out[t];
+  }
+  if(mode == "perthread") {
+    for( int q = 0; q < (int)queues.size(); q++ ) {
+      clReleaseCommandQueue(queues[q]);
+    }
+  }
+  for( int t = 0; t < numThreads + 1; t++ ) {
+    clReleaseKernel(kernels[t]);
+  }
+  delete[] in1;
+  delete[] in2;
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  int maxThreads = 8;
+  if( argc >= 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  if( argc >= 3 ) {
+    maxThreads = atoi(argv[2]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  cl_int err;
+  const char *source = kernelSource;
+  cl_program program = clCreateProgramWithSource(*cl->context, 1, &source, 0, &err);
+  EasyCL::checkError(err);
+  EasyCL::checkError(clBuildProgram(program, 1, &cl->device, "", 0, 0));
+  string modes[] = { "shared", "perthread", "handoff" };
+  for( int numThreads = 1; numThreads <= maxThreads; numThreads *= 2 ) {
+    for( int m = 0; m < 3; m++ ) {
+      test(cl, program, 900, 6400, numThreads, modes[m]);
+    }
+  }
+  clReleaseProgram(program);
+  delete cl;
+  return 0;
+}
@@ -3,6 +3,9 @@ using namespace std;
 #include "EasyCL.h"
 #include "util/StatefulTimer.h"
 #include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "kernelresources.h"
 
 static const char *kernelSource = R"DELIM(
   kernel void test(int totalN, global float*out) {
@@ -21,6 +24,7 @@ static const char *kernelSource = R"DELIM(
 )DELIM";
 
 void test(EasyCL *cl, int privateSize) {
+  resetMemoryStats();
   int totalN = 128 * 1024 * 1024;
   string templatedSource = easycl::replaceGlobal(kernelSource, "{{privatesize}}", easycl::toString(privateSize));
   CLKernel *kernel = cl->buildKernelFromString(templatedSource, "test", "");
@@ -33,7 +37,7 @@ void test(EasyCL *cl, int privateSize) {
       in[i] = inOut[i] = (i + 4) % 1000000;
   }
   CLWrapper *wrapper = cl->wrap(totalN, inOut);
-  wrapper->copyToDevice();
+  memoryCopyToDevice(wrapper);
 
   cl->finish();
 
@@ -43,8 +47,10 @@ void test(EasyCL *cl, int privateSize) {
   kernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
   cl->finish();
   double end = StatefulTimer::instance()->getSystemMilliseconds();
-  wrapper->copyToHost();
-  cout << "privateSize=" << privateSize << " time=" << (end - start) << "ms" << endl;
+  memoryCopyToHost(wrapper);
+  cout << "privateSize=" << privateSize << " time=" << (end - start) << "ms"
+    << rooflineString(end - start, (double)totalN * 2 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, templatedSource, "test", workgroupSize) << endl;
 
   int errorCount = 0;
   for( int i = 0; i < totalN; i++ ) {
@@ -59,7 +65,9 @@ void test(EasyCL *cl, int privateSize) {
 //    cout << "No errors detected" << endl;
   }
 
-  delete wrapper;
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(wrapper);
   delete[] in;
   delete[] inOut;
   delete kernel;
@@ -71,6 +79,7 @@ int main(int argc, char *argv[]) {
     gpu = atoi(argv[1]);
   }
   cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
   EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
   cl->setProfiling(true);
   for(int p = 0; p < 16; p++) {
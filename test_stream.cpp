@@ -0,0 +1,246 @@
+#include <iostream>
+#include <fstream>
+#include <cmath>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "kernelresources.h"
+
+// device characterization, so the other benchmarks can say how close they are
+// to what the hardware can actually do:
+// - the four STREAM kernels, copy, scale, add, triad, for attainable bandwidth
+// - a long chain of independent float4 mads, for attainable flop rate
+//
+// as for STREAM, each kernel is run several times, and the best time is kept
+// results go to stream_peaks_gpu{gpu}.txt, which roofline.h reads
+
+static const char *streamSource = R"DELIM(
+  kernel void copy(int N, global float4 *c, global const float4 *a) {
+    int id = get_global_id(0);
+    if(id < N) {
+      c[id] = a[id];
+    }
+  }
+  kernel void scale(int N, global float4 *b, global const float4 *c, float s) {
+    int id = get_global_id(0);
+    if(id < N) {
+      b[id] = s * c[id];
+    }
+  }
+  kernel void add(int N, global float4 *c, global const float4 *a, global const float4 *b) {
+    int id = get_global_id(0);
+    if(id < N) {
+      c[id] = a[id] + b[id];
+    }
+  }
+  kernel void triad(int N, global float4 *a, global const float4 *b, global const float4 *c, float s) {
+    int id = get_global_id(0);
+    if(id < N) {
+      a[id] = b[id] + s * c[id];
+    }
+  }
+)DELIM";
+
+// 8 independent chains, so latency is hidden within each work item
+static const char *flopsSource = R"DELIM(
+  kernel void flops(int its, float s, global float *out) {
+    int id = get_global_id(0);
+    float4 x0 = (float4)(id, id + 1, id + 2, id + 3) * 0.0001f;
+    float4 x1 = x0 + 0.1f;
+    float4 x2 = x0 + 0.2f;
+    float4 x3 = x0 + 0.3f;
+    float4 x4 = x0 + 0.4f;
+    float4 x5 = x0 + 0.5f;
+    float4 x6 = x0 + 0.6f;
+    float4 x7 = x0 + 0.7f;
+    for(int i = 0; i < its; i++) {
+      x0 = mad(x0, s, 0.5f);
+      x1 = mad(x1, s, 0.5f);
+      x2 = mad(x2, s, 0.5f);
+      x3 = mad(x3, s, 0.5f);
+      x4 = mad(x4, s, 0.5f);
+      x5 = mad(x5, s, 0.5f);
+      x6 = mad(x6, s, 0.5f);
+      x7 = mad(x7, s, 0.5f);
+    }
+    float4 sum = x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7;
+    out[id] = sum.x + sum.y + sum.z + sum.w;
+  }
+)DELIM";
+
+double bestOf(double best, double time) {
+  if(best < 0 || time < best) {
+    return time;
+  }
+  return best;
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+  const int its = 10;
+  const int workgroupSize = 64;
+
+  int totalN = 32 * 1024 * 1024;
+  int N4 = totalN / 4;
+  int numWorkgroups = (N4 + workgroupSize - 1) / workgroupSize;
+  float *a = new float[totalN];
+  float *b = new float[totalN];
+  float *c = new float[totalN];
+  for( int i = 0; i < totalN; i++ ) {
+    a[i] = 1.0f;
+    b[i] = 2.0f;
+    c[i] = 0.0f;
+  }
+  CLWrapper *awrap = cl->wrap(totalN, a);
+  CLWrapper *bwrap = cl->wrap(totalN, b);
+  CLWrapper *cwrap = cl->wrap(totalN, c);
+  awrap->copyToDevice();
+  bwrap->copyToDevice();
+  cwrap->copyToDevice();
+
+  CLKernel *copyKernel = cl->buildKernelFromString(streamSource, "copy", "");
+  CLKernel *scaleKernel = cl->buildKernelFromString(streamSource, "scale", "");
+  CLKernel *addKernel = cl->buildKernelFromString(streamSource, "add", "");
+  CLKernel *triadKernel = cl->buildKernelFromString(streamSource, "triad", "");
+  const float s = 3.0f;
+
+  double copyTime = -1, scaleTime = -1, addTime = -1, triadTime = -1;
+  for( int it = 0; it < its; it++ ) {
+    cl->finish();
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    copyKernel->in(N4);
+    copyKernel->out(cwrap);
+    copyKernel->in(awrap);
+    copyKernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    cl->finish();
+    double end = StatefulTimer::instance()->getSystemMilliseconds();
+    copyTime = bestOf(copyTime, end - start);
+
+    start = end;
+    scaleKernel->in(N4);
+    scaleKernel->out(bwrap);
+    scaleKernel->in(cwrap);
+    scaleKernel->in(s);
+    scaleKernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    cl->finish();
+    end = StatefulTimer::instance()->getSystemMilliseconds();
+    scaleTime = bestOf(scaleTime, end - start);
+
+    start = end;
+    addKernel->in(N4);
+    addKernel->out(cwrap);
+    addKernel->in(awrap);
+    addKernel->in(bwrap);
+    addKernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    cl->finish();
+    end = StatefulTimer::instance()->getSystemMilliseconds();
+    addTime = bestOf(addTime, end - start);
+
+    start = end;
+    triadKernel->in(N4);
+    triadKernel->out(awrap);
+    triadKernel->in(bwrap);
+    triadKernel->in(cwrap);
+    triadKernel->in(s);
+    triadKernel->run_1d(numWorkgroups * workgroupSize, workgroupSize);
+    cl->finish();
+    end = StatefulTimer::instance()->getSystemMilliseconds();
+    triadTime = bestOf(triadTime, end - start);
+  }
+  double bytes = (double)totalN * sizeof(float);
+  double copyGBs = 2 * bytes / copyTime / 1000.0 / 1000.0;
+  double scaleGBs = 2 * bytes / scaleTime / 1000.0 / 1000.0;
+  double addGBs = 3 * bytes / addTime / 1000.0 / 1000.0;
+  double triadGBs = 3 * bytes / triadTime / 1000.0 / 1000.0;
+  cout << "copy time=" << copyTime << "ms GB/s=" << copyGBs
+    << kernelResourceString(cl, streamSource, "copy", workgroupSize) << endl;
+  cout << "scale time=" << scaleTime << "ms GB/s=" << scaleGBs
+    << kernelResourceString(cl, streamSource, "scale", workgroupSize) << endl;
+  cout << "add time=" << addTime << "ms GB/s=" << addGBs
+    << kernelResourceString(cl, streamSource, "add", workgroupSize) << endl;
+  cout << "triad time=" << triadTime << "ms GB/s=" << triadGBs
+    << kernelResourceString(cl, streamSource, "triad", workgroupSize) << endl;
+
+  // replay the same sequence on the host.  the device may contract the triad
+  // into a mad, so allow a little relative error
+  awrap->copyToHost();
+  float aValue = 1.0f;
+  float bValue = 2.0f;
+  float cValue = 0.0f;
+  for( int it = 0; it < its; it++ ) {
+    cValue = aValue;
+    bValue = s * cValue;
+    cValue = aValue + bValue;
+    aValue = bValue + s * cValue;
+  }
+  int errorCount = 0;
+  for( int i = 0; i < totalN; i++ ) {
+    if(abs(a[i] - aValue) > abs(aValue) / 100000.0f) {
+      errorCount++;
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of totalN=" << totalN << endl;
+  }
+
+  delete copyKernel;
+  delete scaleKernel;
+  delete addKernel;
+  delete triadKernel;
+  delete awrap;
+  delete bwrap;
+  delete cwrap;
+  delete[] a;
+  delete[] b;
+  delete[] c;
+
+  // flops: enough work items to fill any device, and long enough per item that
+  // the launch and the store dont matter
+  int flopsN = 1024 * 1024;
+  int flopsIts = 1024;
+  float *out = new float[flopsN];
+  CLWrapper *outwrap = cl->wrap(flopsN, out);
+  outwrap->createOnDevice();
+  CLKernel *flopsKernel = cl->buildKernelFromString(flopsSource, "flops", "");
+  double flopsTime = -1;
+  for( int it = 0; it < its; it++ ) {
+    cl->finish();
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    flopsKernel->in(flopsIts);
+    flopsKernel->in(0.999f);
+    flopsKernel->out(outwrap);
+    flopsKernel->run_1d(flopsN, workgroupSize);
+    cl->finish();
+    double end = StatefulTimer::instance()->getSystemMilliseconds();
+    flopsTime = bestOf(flopsTime, end - start);
+  }
+  // 8 chains * float4 * mad = 64 flops per iteration
+  double flops = (double)flopsN * flopsIts * 8 * 4 * 2;
+  double gflops = flops / flopsTime / 1000.0 / 1000.0;
+  cout << "flops time=" << flopsTime << "ms GFLOP/s=" << gflops
+    << kernelResourceString(cl, flopsSource, "flops", workgroupSize) << endl;
+  delete flopsKernel;
+  delete outwrap;
+  delete[] out;
+
+  string filename = rooflinePeaksFilename(gpu);
+  ofstream f(filename.c_str());
+  f << "copy=" << copyGBs << endl;
+  f << "scale=" << scaleGBs << endl;
+  f << "add=" << addGBs << endl;
+  f << "triad=" << triadGBs << endl;
+  f << "gflops=" << gflops << endl;
+  f.close();
+  cout << "wrote " << filename << endl;
+
+  delete cl;
+  return 0;
+}
+
@@ -0,0 +1,274 @@
+#include <iostream>
+#include <cmath>
+#include <map>
+#include <vector>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// how should narrow() and select() views reach a kernel: as an int offset
+// into the parent buffer, as test_launch and test_apply1 do, and as Info's
+// offset field does, or as a clCreateSubBuffer view of just the slice
+//
+// one parent buffer, holding numSlices slices, launches cycle through them,
+// adding 1 to each element of the slice
+//
+// modes:
+// - offset: the parent buffer, plus the slice's offset as a kernel argument
+// - subbuffer: a new sub-buffer for every launch, released straight after
+//   enqueueing, which is what a view created on the fly costs
+// - pool: sub-buffers cached by origin and size, created on first use
+//
+// sub-buffer origins must be multiples of CL_DEVICE_MEM_BASE_ADDR_ALIGN, so
+// slices are laid out on aligned boundaries.  misaligned slices start one
+// float later; for those the sub-buffer starts at the aligned origin below,
+// and the remainder goes in as an offset argument, since creating one at the
+// slice's own origin fails, with CL_MISALIGNED_SUB_BUFFER_OFFSET
+//
+// reported:
+// - creation: time to create and release a sub-buffer
+// - per launch: host enqueue time, which includes any creation, and total
+// - at 6400 elements, where launch cost dominates, and 16M, where the kernel
+//   does
+//
+// CLWrapper cant make sub-buffers, so this uses the OpenCL api directly
+
+static const char *kernelSource = R"DELIM(
+  kernel void withOffset(int offset, int N, global float *out) {
+    int linearId = get_global_id(0);
+    if(linearId < N) {
+      out[offset + linearId] = out[offset + linearId] + 1.0f;
+    }
+  }
+
+  kernel void view(int N, global float *out) {
+    int linearId = get_global_id(0);
+    if(linearId < N) {
+      out[linearId] = out[linearId] + 1.0f;
+    }
+  }
+)DELIM";
+
+void setArg(cl_kernel kernel, int argIndex, int value) {
+  EasyCL::checkError(clSetKernelArg(kernel, argIndex, sizeof(value), &value));
+}
+
+void setArg(cl_kernel kernel, int argIndex, cl_mem buffer) {
+  EasyCL::checkError(clSetKernelArg(kernel, argIndex, sizeof(buffer), &buffer));
+}
+
+cl_mem createSubBuffer(cl_mem parent, size_t originFloats, size_t numFloats, cl_int *err) {
+  cl_buffer_region region;
+  region.origin = originFloats * sizeof(float);
+  region.size = numFloats * sizeof(float);
+  return clCreateSubBuffer(parent, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, err);
+}
+
+class SubBufferPool {
+public:
+  map< pair<size_t, size_t>, cl_mem > subBuffers;
+  cl_mem get(cl_mem parent, size_t originFloats, size_t numFloats) {
+    pair<size_t, size_t> key(originFloats, numFloats);
+    if(subBuffers.find(key) == subBuffers.end()) {
+      cl_int err;
+      subBuffers[key] = createSubBuffer(parent, originFloats, numFloats, &err);
+      EasyCL::checkError(err);
+    }
+    return subBuffers[key];
+  }
+  void clear() {
+    for( map< pair<size_t, size_t>, cl_mem >::iterator it = subBuffers.begin(); it != subBuffers.end(); it++ ) {
+      clReleaseMemObject(it->second);
+    }
+    subBuffers.clear();
+  }
+};
+
+typedef struct Kernels {
+  cl_program program;
+  cl_kernel withOffset;
+  cl_kernel view;
+} Kernels;
+
+void enqueue(EasyCL *cl, cl_kernel kernel, int N) {
+  const int workgroupSize = 64;
+  size_t global = ((N + workgroupSize - 1) / workgroupSize) * workgroupSize;
+  size_t local = workgroupSize;
+  EasyCL::checkError(clEnqueueNDRangeKernel(*cl->queue, kernel, 1, 0, &global, &local, 0, 0, 0));
+}
+
+// one launch on the slice at origin
+void launch(EasyCL *cl, const Kernels &kernels, SubBufferPool *pool, cl_mem parent, string mode,
+    size_t origin, int N, int alignFloats) {
+  if(mode == "offset") {
+    setArg(kernels.withOffset, 0, (int)origin);
+    setArg(kernels.withOffset, 1, N);
+    setArg(kernels.withOffset, 2, parent);
+    enqueue(cl, kernels.withOffset, N);
+    return;
+  }
+  int remainder = origin % alignFloats;
+  size_t alignedOrigin = origin - remainder;
+  cl_mem subBuffer;
+  if(mode == "pool") {
+    subBuffer = pool->get(parent, alignedOrigin, remainder + N);
+  } else {
+    cl_int err;
+    subBuffer = createSubBuffer(parent, alignedOrigin, remainder + N, &err);
+    EasyCL::checkError(err);
+  }
+  if(remainder == 0) {
+    setArg(kernels.view, 0, N);
+    setArg(kernels.view, 1, subBuffer);
+    enqueue(cl, kernels.view, N);
+  } else {
+    setArg(kernels.withOffset, 0, remainder);
+    setArg(kernels.withOffset, 1, N);
+    setArg(kernels.withOffset, 2, subBuffer);
+    enqueue(cl, kernels.withOffset, N);
+  }
+  if(mode == "subbuffer") {
+    // the runtime keeps it alive until the kernel using it is done
+    clReleaseMemObject(subBuffer);
+  }
+}
+
+void test(EasyCL *cl, const Kernels &kernels, int sliceN, int numSlices, bool misaligned) {
+  resetMemoryStats();
+  cl_uint alignBits = 0;
+  EasyCL::checkError(clGetDeviceInfo(cl->device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(alignBits), &alignBits, 0));
+  int alignFloats = max(1, (int)(alignBits / 8 / sizeof(float)));
+  int sliceStride = ((sliceN + 1 + alignFloats - 1) / alignFloats) * alignFloats;
+  size_t parentN = (size_t)sliceStride * numSlices;
+  vector<size_t> origins;
+  for( int s = 0; s < numSlices; s++ ) {
+    origins.push_back((size_t)s * sliceStride + (misaligned ? 1 : 0));
+  }
+  string alignment = misaligned ? "misaligned" : "aligned";
+
+  cl_int err;
+  float *host = new float[parentN];
+  for( size_t i = 0; i < parentN; i++ ) {
+    host[i] = i % 1000;
+  }
+  cl_mem parent = clCreateBuffer(*cl->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, parentN * sizeof(float), host, &err);
+  EasyCL::checkError(err);
+  memoryRawAllocated((double)parentN * sizeof(float));
+  memoryRawCopied((double)parentN * sizeof(float), 0);
+
+  // creation cost, and whether the driver takes a misaligned origin anyway
+  cl_int directErr;
+  cl_mem direct = createSubBuffer(parent, origins[0], sliceN, &directErr);
+  if(directErr == CL_SUCCESS) {
+    clReleaseMemObject(direct);
+  }
+  AdaptiveResult creation = measureAdaptive([&]() {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    vector<cl_mem> subBuffers;
+    for( int s = 0; s < numSlices; s++ ) {
+      int remainder = origins[s] % alignFloats;
+      subBuffers.push_back(createSubBuffer(parent, origins[s] - remainder, remainder + sliceN, &err));
+      EasyCL::checkError(err);
+    }
+    for( int s = 0; s < numSlices; s++ ) {
+      clReleaseMemObject(subBuffers[s]);
+    }
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  cout << "subbuffer creation slice=" << sliceN << " " << alignment << " alignbytes=" << alignBits / 8
+    << " directcreate=" << (directErr == CL_SUCCESS ? "ok" : "error " + easycl::toString(directErr))
+    << adaptiveString(creation) << " per subbuffer=" << creation.median / numSlices * 1000 << "us" << endl;
+
+  string modes[] = { "offset", "subbuffer", "pool" };
+  // launches run on each slice, over all modes, for the check
+  vector<long long> sliceLaunches(numSlices, 0);
+  for( int m = 0; m < 3; m++ ) {
+    string mode = modes[m];
+    SubBufferPool pool;
+    double enqueueMilliseconds = 0;
+    long long numLaunches = 0;
+    AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+      double start = StatefulTimer::instance()->getSystemMilliseconds();
+      for( int it = 0; it < batchSize; it++ ) {
+        int slice = (int)(numLaunches % numSlices);
+        launch(cl, kernels, &pool, parent, mode, origins[slice], sliceN, alignFloats);
+        sliceLaunches[slice]++;
+        numLaunches++;
+      }
+      enqueueMilliseconds += StatefulTimer::instance()->getSystemMilliseconds() - start;
+      clFinish(*cl->queue);
+      return StatefulTimer::instance()->getSystemMilliseconds() - start;
+    });
+    cout << "subbuffer slice=" << sliceN << " slices=" << numSlices << " " << alignment << " mode=" << mode
+      << adaptiveString(result)
+      << " enqueue/launch=" << enqueueMilliseconds / numLaunches * 1000 << "us"
+      << rooflineString(result.median, (double)sliceN * 2 * sizeof(float), (double)sliceN)
+      << kernelResourceString(cl, kernels.withOffset, 64) << endl;
+    pool.clear();
+  }
+
+  EasyCL::checkError(clEnqueueReadBuffer(*cl->queue, parent, CL_TRUE, 0, parentN * sizeof(float), host, 0, 0, 0));
+  memoryRawCopied(0, (double)parentN * sizeof(float));
+  vector<float> visits(parentN, 0);
+  for( int s = 0; s < numSlices; s++ ) {
+    for( int i = 0; i < sliceN; i++ ) {
+      visits[origins[s] + i] += sliceLaunches[s];
+    }
+  }
+  int errorCount = 0;
+  for( size_t i = 0; i < parentN; i++ ) {
+    float targetValue = i % 1000 + visits[i];
+    if(host[i] != targetValue) {
+      errorCount++;
+      if( errorCount < 20 ) {
+        cout << "host[" << i << "]=" << host[i] << " != " << targetValue << endl;
+      }
+    }
+  }
+  if( errorCount > 0 ) {
+    cout << "errors: " << errorCount << " out of parentN=" << parentN << endl;
+  }
+
+  cout << "memory" << memoryString() << endl;
+
+  clReleaseMemObject(parent);
+  memoryRawReleased((double)parentN * sizeof(float));
+  delete[] host;
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc == 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+
+  Kernels kernels;
+  cl_int err;
+  const char *source = kernelSource;
+  kernels.program = clCreateProgramWithSource(*cl->context, 1, &source, 0, &err);
+  EasyCL::checkError(err);
+  EasyCL::checkError(clBuildProgram(kernels.program, 1, &cl->device, "", 0, 0));
+  kernels.withOffset = clCreateKernel(kernels.program, "withOffset", &err);
+  EasyCL::checkError(err);
+  kernels.view = clCreateKernel(kernels.program, "view", &err);
+  EasyCL::checkError(err);
+
+  for( int misaligned = 0; misaligned <= 1; misaligned++ ) {
+    test(cl, kernels, 6400, 64, misaligned == 1);
+    test(cl, kernels, 16 * 1024 * 1024, 4, misaligned == 1);
+  }
+
+  clReleaseKernel(kernels.withOffset);
+  clReleaseKernel(kernels.view);
+  clReleaseProgram(kernels.program);
+  delete cl;
+  return 0;
+}
@@ -0,0 +1,585 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+using namespace std;
+#include "EasyCL.h"
+#include "util/StatefulTimer.h"
+#include "util/easycl_stringhelper.h"
+#include "templates/TemplatedKernel.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "adaptive.h"
+#include "kernelresources.h"
+
+// parameter sweeps, driven by a declarative grid, rather than loops in main()
+//
+// grid format, one sweep per line, # for comments:
+//   <benchmark> <param>=<values> <param>=<values> ...
+// values can be:
+//   1,2,4,8          list
+//   0..14+2          arithmetic range, inclusive
+//   1..16384*4       geometric range, inclusive
+// each line runs the cartesian product of its params
+//
+// all the kernel variants the grid needs are worked out up front, and each is
+// compiled exactly once, on a pool of host threads.  runs execute in grid
+// order as soon as their variant is ready, so compilation of later variants
+// overlaps with execution on the device.  buffers are set up once, and reused
+// for as long as consecutive runs want the same size.  each run is repeated
+// until its median is stable, see adaptive.h
+//
+// compilation goes through the OpenCL api directly, since clBuildProgram is
+// thread-safe, but EasyCL's kernel store isnt
+
+static const char *defaultGrid = R"DELIM(
+# as test_launch main(), but sizes outermost, so each buffer is set up once
+launch totalN=33554432..268435456*2 numLaunches=1..16384*4
+# as test_apply3_flat main()
+apply3flat size=6400 numVirtualDims=1,2,4,5,10,15,16,20,25
+# as test_applystrided testTranspose()
+applystrided size1=4,32,64,128 transposed=0,1
+)DELIM";
+
+static const char *launchSource = R"DELIM(
+  kernel void test(int offset, int totalN, global float*out) {
+    int linearId = get_global_id(0) + offset;
+    if(linearId < totalN) {
+      out[linearId] = out[linearId] + 1.0f;
+    }
+  }
+)DELIM";
+
+static const char *apply3flatSource = R"DELIM(
+  kernel void test(int totalN,
+      int out_offset,
+      int out_dims,
+      {% for i=1,numVirtualDims do %}
+      int out_dim{{i}},
+      int out_stride{{i}},
+      {% end %}
+      global float*out_data,
+      int in1_offset,
+      int in1_dims,
+      {% for i=1,numVirtualDims do %}
+      int in1_dim{{i}},
+      int in1_stride{{i}},
+      {% end %}
+      global float *in1_data,
+      int in2_offset,
+      int in2_dims,
+      {% for i=1,numVirtualDims do %}
+      int in2_dim{{i}},
+      int in2_stride{{i}},
+      {% end %}
+      global float *in2_data
+      ) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      out_data[linearId + out_offset] = in1_data[linearId + in1_offset] * in2_data[linearId + in2_offset]
+      {% for i=1,numVirtualDims do %}
+      + out_dim{{i}}
+      + out_stride{{i}}
+      + in1_dim{{i}}
+      + in1_stride{{i}}
+      + in2_dim{{i}}
+      + in2_stride{{i}}
+      {% end %}
+      ;
+    }
+  }
+)DELIM";
+
+static const char *applystridedSource = R"DELIM(
+  #define STRIDE0 {{stride0}}
+  #define STRIDE1 {{stride1}}
+  #define SIZE1 {{size1}}
+  kernel void test(int totalN, global float*_out) {
+    int linearId = get_global_id(0);
+    if(linearId < totalN) {
+      int x1 = linearId % SIZE1;
+      int x0 = linearId / SIZE1;
+      int storageOffset = x0 * STRIDE0 + x1 * STRIDE1;
+      float out = _out[storageOffset];
+      _out[storageOffset] = out + 3.3f;
+    }
+  }
+)DELIM";
+
+typedef map<string, int> Params;
+
+typedef struct Variant {
+  string key;
+  string source;
+  cl_program program;
+  cl_kernel kernel;
+  bool ready;
+  string error;
+  double buildTime;
+} Variant;
+
+typedef struct Run {
+  string benchmark;
+  Params params;
+  Variant *variant;
+} Run;
+
+int getParam(const Params &params, string name, int defaultValue) {
+  Params::const_iterator it = params.find(name);
+  if(it == params.end()) {
+    return defaultValue;
+  }
+  return it->second;
+}
+
+string paramsToString(const Params &params) {
+  string result = "";
+  for(Params::const_iterator it = params.begin(); it != params.end(); it++) {
+    result += " " + it->first + "=" + easycl::toString(it->second);
+  }
+  return result;
+}
+
+// whole string must be an int, so that eg 4x is an error rather than 4
+int parseInt(string text, string spec) {
+  char *end = 0;
+  errno = 0;
+  long value = strtol(text.c_str(), &end, 10);
+  if(text.empty() || *end != '\0' || errno == ERANGE || value < INT_MIN || value > INT_MAX) {
+    throw runtime_error("not an int: '" + text + "' in " + spec);
+  }
+  return (int)value;
+}
+
+vector<int> parseValues(string spec) {
+  vector<int> values;
+  size_t dots = spec.find("..");
+  if(dots == string::npos) {
+    vector<string> parts = easycl::split(spec, ",");
+    for( int i = 0; i < (int)parts.size(); i++ ) {
+      values.push_back(parseInt(parts[i], spec));
+    }
+    return values;
+  }
+  int first = parseInt(spec.substr(0, dots), spec);
+  string rest = spec.substr(dots + 2);
+  size_t op = rest.find_first_of("+*");
+  if(op == string::npos) {
+    throw runtime_error("range needs +step or *factor: " + spec);
+  }
+  int last = parseInt(rest.substr(0, op), spec);
+  int step = parseInt(rest.substr(op + 1), spec);
+  bool geometric = rest[op] == '*';
+  if(step <= (geometric ? 1 : 0)) {
+    throw runtime_error("range step would never finish: " + spec);
+  }
+  // 0 stays at 0, and negatives grow away from last
+  if(geometric && first <= 0) {
+    throw runtime_error("geometric range must start above 0: " + spec);
+  }
+  for( long long value = first; value <= last; value = geometric ? value * step : value + step ) {
+    values.push_back((int)value);
+  }
+  return values;
+}
+
+// cartesian product of the params on one line, first param varying slowest
+void expandLine(string benchmark, const vector<pair<string, vector<int> > > &axes, int axis, Params params, vector<Run> *runs) {
+  if(axis == (int)axes.size()) {
+    Run run;
+    run.benchmark = benchmark;
+    run.params = params;
+    run.variant = 0;
+    runs->push_back(run);
+    return;
+  }
+  const vector<int> &values = axes[axis].second;
+  for( int i = 0; i < (int)values.size(); i++ ) {
+    params[axes[axis].first] = values[i];
+    expandLine(benchmark, axes, axis + 1, params, runs);
+  }
+}
+
+vector<Run> parseGrid(istream &in) {
+  vector<Run> runs;
+  string line;
+  while(getline(in, line)) {
+    size_t hash = line.find('#');
+    if(hash != string::npos) {
+      line = line.substr(0, hash);
+    }
+    istringstream words(line);
+    string benchmark;
+    if(!(words >> benchmark)) {
+      continue;
+    }
+    vector<pair<string, vector<int> > > axes;
+    string word;
+    while(words >> word) {
+      size_t equals = word.find('=');
+      if(equals == string::npos) {
+        throw runtime_error("expected param=values, got: " + word);
+      }
+      axes.push_back(make_pair(word.substr(0, equals), parseValues(word.substr(equals + 1))));
+    }
+    expandLine(benchmark, axes, 0, Params(), &runs);
+  }
+  return runs;
+}
+
+// variant key is just the params that change the kernel source
+string variantKey(const Run &run) {
+  if(run.benchmark == "launch") {
+    return "launch";
+  } else if(run.benchmark == "apply3flat") {
+    return "apply3flat_" + easycl::toString(getParam(run.params, "numVirtualDims", 1));
+  } else if(run.benchmark == "applystrided") {
+    return "applystrided_" + easycl::toString(getParam(run.params, "size1", 32))
+      + "_" + easycl::toString(getParam(run.params, "transposed", 0))
+      + "_" + easycl::toString(getParam(run.params, "totalN", 128 * 1024 * 1024));
+  }
+  throw runtime_error("unknown benchmark " + run.benchmark);
+}
+
+// rendering is cheap, and TemplatedKernel needs the EasyCL lua state, so this
+// happens on the main thread; only the compile goes to the pool
+string renderSource(EasyCL *cl, const Run &run) {
+  if(run.benchmark == "launch") {
+    return launchSource;
+  } else if(run.benchmark == "apply3flat") {
+    TemplatedKernel kernelBuilder(cl);
+    kernelBuilder.set("numVirtualDims", getParam(run.params, "numVirtualDims", 1));
+    return kernelBuilder.getRenderedKernel(apply3flatSource);
+  } else {
+    int totalN = getParam(run.params, "totalN", 128 * 1024 * 1024);
+    int size1 = getParam(run.params, "size1", 32);
+    int size0 = totalN / size1;
+    int stride0 = size1;
+    int stride1 = 1;
+    string source = applystridedSource;
+    if(getParam(run.params, "transposed", 0)) {
+      source = easycl::replace(source, "{{stride0}}", easycl::toString(stride1));
+      source = easycl::replace(source, "{{stride1}}", easycl::toString(stride0));
+      source = easycl::replace(source, "{{size1}}", easycl::toString(size0));
+    } else {
+      source = easycl::replace(source, "{{stride0}}", easycl::toString(stride0));
+      source = easycl::replace(source, "{{stride1}}", easycl::toString(stride1));
+      source = easycl::replace(source, "{{size1}}", easycl::toString(size1));
+    }
+    return source;
+  }
+}
+
+class BuildPool {
+public:
+  BuildPool(EasyCL *cl, int numThreads) : cl(cl), stopping(false) {
+    for( int i = 0; i < numThreads; i++ ) {
+      threads.push_back(thread(&BuildPool::worker, this));
+    }
+  }
+  ~BuildPool() {
+    {
+      unique_lock<mutex> lock(m);
+      stopping = true;
+    }
+    todoChanged.notify_all();
+    for( int i = 0; i < (int)threads.size(); i++ ) {
+      threads[i].join();
+    }
+  }
+  void submit(Variant *variant) {
+    {
+      unique_lock<mutex> lock(m);
+      todo.push_back(variant);
+    }
+    todoChanged.notify_one();
+  }
+  void waitFor(Variant *variant) {
+    unique_lock<mutex> lock(m);
+    while(!variant->ready) {
+      doneChanged.wait(lock);
+    }
+  }
+
+protected:
+  void worker() {
+    while(true) {
+      Variant *variant = 0;
+      {
+        unique_lock<mutex> lock(m);
+        while(todo.size() == 0 && !stopping) {
+          todoChanged.wait(lock);
+        }
+        if(todo.size() == 0) {
+          return;
+        }
+        variant = todo.front();
+        todo.pop_front();
+      }
+      build(variant);
+      {
+        unique_lock<mutex> lock(m);
+        variant->ready = true;
+      }
+      doneChanged.notify_all();
+    }
+  }
+  void build(Variant *variant) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    cl_int err;
+    const char *source = variant->source.c_str();
+    size_t length = variant->source.size();
+    variant->program = clCreateProgramWithSource(*cl->context, 1, &source, &length, &err);
+    if(err == CL_SUCCESS) {
+      err = clBuildProgram(variant->program, 1, &cl->device, "", 0, 0);
+    }
+    if(err == CL_SUCCESS) {
+      variant->kernel = clCreateKernel(variant->program, "test", &err);
+    }
+    if(err != CL_SUCCESS) {
+      variant->error = "build failed, error " + easycl::toString(err);
+      if(variant->program != 0) {
+        size_t logSize = 0;
+        clGetProgramBuildInfo(variant->program, cl->device, CL_PROGRAM_BUILD_LOG, 0, 0, &logSize);
+        vector<char> log(logSize + 1);
+        clGetProgramBuildInfo(variant->program, cl->device, CL_PROGRAM_BUILD_LOG, logSize, &log[0], 0);
+        variant->error += ":\n" + string(&log[0]);
+      }
+    }
+    variant->buildTime = StatefulTimer::instance()->getSystemMilliseconds() - start;
+  }
+
+  EasyCL *cl;
+  vector<thread> threads;
+  deque<Variant *> todo;
+  mutex m;
+  condition_variable todoChanged;
+  condition_variable doneChanged;
+  bool stopping;
+};
+
+// buffers for each benchmark, kept while consecutive runs use the same size,
+// and replaced when the size changes, so a sweep over sizes doesnt pile them up
+class Setups {
+public:
+  Setups(EasyCL *cl) : cl(cl) {
+  }
+  ~Setups() {
+    for(map<string, CLWrapper *>::iterator it = wrappers.begin(); it != wrappers.end(); it++) {
+      release(it->first);
+    }
+  }
+  CLWrapper *get(string name, int N) {
+    if(wrappers.find(name) != wrappers.end() && wrappers[name]->size() != N) {
+      release(name);
+      wrappers.erase(name);
+    }
+    if(wrappers.find(name) == wrappers.end()) {
+      float *array = new float[N];
+      for( int i = 0; i < N; i++ ) {
+        array[i] = (i + 4) % 1000000;
+      }
+      CLWrapper *wrapper = cl->wrap(N, array);
+      memoryCopyToDevice(wrapper);
+      arrays[name] = array;
+      wrappers[name] = wrapper;
+    }
+    return wrappers[name];
+  }
+
+protected:
+  void release(string name) {
+    memoryDelete(wrappers[name]);
+    delete[] arrays[name];
+    arrays.erase(name);
+  }
+
+  EasyCL *cl;
+  map<string, float *> arrays;
+  map<string, CLWrapper *> wrappers;
+};
+
+void setArg(cl_kernel kernel, int *argIndex, int value) {
+  EasyCL::checkError(clSetKernelArg(kernel, (*argIndex)++, sizeof(value), &value));
+}
+
+void setArg(cl_kernel kernel, int *argIndex, CLWrapper *wrapper) {
+  cl_mem buffer = wrapper->getBuffer();
+  EasyCL::checkError(clSetKernelArg(kernel, (*argIndex)++, sizeof(buffer), &buffer));
+}
+
+void enqueue(EasyCL *cl, cl_kernel kernel, int N, int workgroupSize) {
+  size_t global = ((N + workgroupSize - 1) / workgroupSize) * workgroupSize;
+  size_t local = workgroupSize;
+  EasyCL::checkError(clEnqueueNDRangeKernel(*cl->queue, kernel, 1, 0, &global, &local, 0, 0, 0));
+}
+
+// enqueues one sample of the run, and says how many bytes and flops that is
+void enqueueRun(EasyCL *cl, Setups *setups, const Run &run, double *bytes, double *flops) {
+  cl_kernel kernel = run.variant->kernel;
+  const int workgroupSize = 64;
+  if(run.benchmark == "launch") {
+    int totalN = getParam(run.params, "totalN", 100 * 1024 * 1024);
+    int numLaunches = getParam(run.params, "numLaunches", 1);
+    int N = totalN / numLaunches;
+    CLWrapper *wrapper = setups->get("launch", totalN);
+    for( int i = 0; i < numLaunches; i++ ) {
+      int argIndex = 0;
+      setArg(kernel, &argIndex, N * i);
+      setArg(kernel, &argIndex, totalN);
+      setArg(kernel, &argIndex, wrapper);
+      enqueue(cl, kernel, N, workgroupSize);
+    }
+    *bytes = (double)totalN * 2 * sizeof(float);
+    *flops = totalN;
+  } else if(run.benchmark == "apply3flat") {
+    int totalN = getParam(run.params, "size", 6400);
+    int numVirtualDims = getParam(run.params, "numVirtualDims", 1);
+    CLWrapper *outwrap = setups->get("apply3_out", totalN);
+    CLWrapper *in1wrap = setups->get("apply3_in1", totalN);
+    CLWrapper *in2wrap = setups->get("apply3_in2", totalN);
+    CLWrapper *wraps[] = { outwrap, in1wrap, in2wrap };
+    int argIndex = 0;
+    setArg(kernel, &argIndex, totalN);
+    for( int t = 0; t < 3; t++ ) {
+      setArg(kernel, &argIndex, 0);
+      setArg(kernel, &argIndex, 2);
+      for( int i = 0; i < numVirtualDims; i++ ) {
+        setArg(kernel, &argIndex, 2);
+        setArg(kernel, &argIndex, 2);
+      }
+      setArg(kernel, &argIndex, wraps[t]);
+    }
+    enqueue(cl, kernel, totalN, workgroupSize);
+    *bytes = (double)totalN * 3 * sizeof(float);
+    *flops = (double)totalN * (1 + 6 * numVirtualDims);
+  } else if(run.benchmark == "applystrided") {
+    int totalN = getParam(run.params, "totalN", 128 * 1024 * 1024);
+    CLWrapper *wrapper = setups->get("applystrided", totalN);
+    int argIndex = 0;
+    setArg(kernel, &argIndex, totalN);
+    setArg(kernel, &argIndex, wrapper);
+    enqueue(cl, kernel, totalN, workgroupSize);
+    *bytes = (double)totalN * 2 * sizeof(float);
+    *flops = totalN;
+  }
+}
+
+// the calibration runs, which adaptive.h discards, do any buffer setup and
+// warm up the kernel, then samples until the median settles
+void execute(EasyCL *cl, Setups *setups, const Run &run) {
+  double bytes = 0;
+  double flops = 0;
+  resetMemoryStats();
+  AdaptiveResult result = measureAdaptiveBatched([&](int batchSize) {
+    double start = StatefulTimer::instance()->getSystemMilliseconds();
+    for( int it = 0; it < batchSize; it++ ) {
+      enqueueRun(cl, setups, run, &bytes, &flops);
+    }
+    cl->finish();
+    return StatefulTimer::instance()->getSystemMilliseconds() - start;
+  });
+  cout << run.benchmark << paramsToString(run.params) << " build=" << run.variant->buildTime << "ms"
+    << adaptiveString(result) << rooflineString(result.median, bytes, flops)
+    << memoryString() << kernelResourceString(cl, run.variant->kernel, 64) << endl;
+}
+
+int main(int argc, char *argv[]) {
+  int gpu = 0;
+  if( argc >= 2 ) {
+    gpu = atoi(argv[1]);
+  }
+  cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
+  vector<Run> runs;
+  try {
+    if( argc >= 3 ) {
+      ifstream f(argv[2]);
+      if(!f) {
+        cout << "couldnt open " << argv[2] << endl;
+        return -1;
+      }
+      runs = parseGrid(f);
+    } else {
+      istringstream f(defaultGrid);
+      runs = parseGrid(f);
+    }
+    // unknown benchmarks throw here, rather than once compiling has started
+    for( int i = 0; i < (int)runs.size(); i++ ) {
+      variantKey(runs[i]);
+    }
+  } catch(runtime_error &e) {
+    cout << "bad grid: " << e.what() << endl;
+    cout << "usage: test_sweep [gpu] [gridfile], grid format is at the top of test_sweep.cpp" << endl;
+    return -1;
+  }
+  EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
+
+  double sweepStart = StatefulTimer::instance()->getSystemMilliseconds();
+  int numThreads = thread::hardware_concurrency();
+  if(numThreads < 1) {
+    numThreads = 1;
+  }
+  map<string, Variant *> variants;
+  {
+    BuildPool pool(cl, numThreads);
+    // queue every variant in the order runs first need it, so the first runs
+    // can start while the rest are still compiling
+    for( int i = 0; i < (int)runs.size(); i++ ) {
+      string key = variantKey(runs[i]);
+      if(variants.find(key) == variants.end()) {
+        Variant *variant = new Variant();
+        variant->key = key;
+        variant->source = renderSource(cl, runs[i]);
+        variant->program = 0;
+        variant->kernel = 0;
+        variant->ready = false;
+        variant->buildTime = 0;
+        variants[key] = variant;
+        pool.submit(variant);
+      }
+      runs[i].variant = variants[key];
+    }
+    cout << "runs=" << runs.size() << " variants=" << variants.size() << " buildthreads=" << numThreads << endl;
+
+    Setups setups(cl);
+    double waitTime = 0;
+    for( int i = 0; i < (int)runs.size(); i++ ) {
+      double waitStart = StatefulTimer::instance()->getSystemMilliseconds();
+      pool.waitFor(runs[i].variant);
+      waitTime += StatefulTimer::instance()->getSystemMilliseconds() - waitStart;
+      if(runs[i].variant->error != "") {
+        cout << runs[i].benchmark << paramsToString(runs[i].params) << " " << runs[i].variant->error << endl;
+        continue;
+      }
+      execute(cl, &setups, runs[i]);
+    }
+    cout << "waiting for builds=" << waitTime << "ms" << endl;
+  }
+  double buildTime = 0;
+  for(map<string, Variant *>::iterator it = variants.begin(); it != variants.end(); it++) {
+    Variant *variant = it->second;
+    buildTime += variant->buildTime;
+    if(variant->kernel != 0) {
+      clReleaseKernel(variant->kernel);
+    }
+    if(variant->program != 0) {
+      clReleaseProgram(variant->program);
+    }
+    delete variant;
+  }
+  double sweepEnd = StatefulTimer::instance()->getSystemMilliseconds();
+  cout << "sweep time=" << (sweepEnd - sweepStart) << "ms total build time=" << buildTime << "ms" << endl;
+  delete cl;
+  return 0;
+}
+
@@ -3,6 +3,9 @@ using namespace std;
 #include "EasyCL.h"
 #include "util/StatefulTimer.h"
 #include "util/easycl_stringhelper.h"
+#include "roofline.h"
+#include "memorystats.h"
+#include "kernelresources.h"
 
 static const char *kernelSource = R"DELIM(
   kernel void test(int offset, int totalN, global float*out) {
@@ -14,6 +17,7 @@ static const char *kernelSource = R"DELIM(
 )DELIM";
 
 void test(EasyCL *cl, int workgroupSize) {
+  resetMemoryStats();
   int numLaunches = 256;
   int vectorSize = 4;
   string arrayType = "float";
@@ -32,7 +36,7 @@ void test(EasyCL *cl, int workgroupSize) {
       in[i] = inOut[i] = (i + 4) % 1000000;
   }
   CLWrapper *wrapper = cl->wrap(totalN, inOut);
-  wrapper->copyToDevice();
+  memoryCopyToDevice(wrapper);
 
   cl->finish();
 
@@ -45,8 +49,10 @@ void test(EasyCL *cl, int workgroupSize) {
   }
   cl->finish();
   double end = StatefulTimer::instance()->getSystemMilliseconds();
-  wrapper->copyToHost();
-  cout << "launches " << numLaunches << " N per launch " << N << " workgroupSize=" << workgroupSize << " time=" << (end - start) << "ms" << endl;
+  memoryCopyToHost(wrapper);
+  cout << "launches " << numLaunches << " N per launch " << N << " workgroupSize=" << workgroupSize << " time=" << (end - start) << "ms"
+    << rooflineString(end - start, (double)totalN * 2 * sizeof(float), (double)totalN)
+    << kernelResourceString(cl, templatedSource, "test", workgroupSize) << endl;
 
   int errorCount = 0;
   for( int i = 0; i < totalN; i++ ) {
@@ -61,7 +67,9 @@ void test(EasyCL *cl, int workgroupSize) {
 //    cout << "No errors detected" << endl;
   }
 
-  delete wrapper;
+  cout << "memory" << memoryString() << endl;
+
+  memoryDelete(wrapper);
   delete[] in;
   delete[] inOut;
   delete kernel;
@@ -82,6 +90,7 @@ int main(int argc, char *argv[]) {
     gpu = atoi(argv[1]);
   }
   cout << "using gpu " << gpu << endl;
+  loadRooflinePeaks(gpu);
   EasyCL *cl = EasyCL::createForIndexedGpu(gpu);
   cl->setProfiling(true);
   testOperations(cl);